@@ -0,0 +1,107 @@
+#ifndef _KSHIM_H
+#define _KSHIM_H
+
+// Just enough of the kernel API for src/modlist_core.c to build as a
+// regular userspace program, on top of the list.h and rbtree.h ports
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// list.h brings its own offsetof
+#undef offsetof
+#include "list.h"
+#include "rbtree.h"
+
+typedef int64_t s64;
+typedef uint32_t u32;
+typedef uint16_t u16;
+
+#define GFP_KERNEL 0
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+// Helpers newer than list.h
+#define list_first_entry(ptr, type, member) \
+  list_entry((ptr)->next, type, member)
+
+#define list_last_entry(ptr, type, member) \
+  list_entry((ptr)->prev, type, member)
+
+#define list_for_each_entry_from(pos, head, member) \
+  for (; &pos->member != (head);                    \
+       pos = list_entry(pos->member.next, typeof(*pos), member))
+
+#define hlist_entry_safe(ptr, type, member)                   \
+  ({                                                          \
+    typeof(ptr) ____ptr = (ptr);                              \
+    ____ptr ? hlist_entry(____ptr, type, member) : NULL;      \
+  })
+
+// linux/hashtable.h, same hash function so chains look the same
+#define GOLDEN_RATIO_32 0x61C88647
+
+static inline u32 hash_32(u32 val, unsigned int bits) {
+  return (val * GOLDEN_RATIO_32) >> (32 - bits);
+}
+
+#define DEFINE_HASHTABLE(name, bits) \
+  struct hlist_head name[1 << (bits)]
+
+#define HASH_SIZE(name) (ARRAY_SIZE(name))
+#define HASH_BITS(name) (__builtin_ctz(HASH_SIZE(name)))
+#define hash_min(val, bits) hash_32(val, bits)
+
+#define hash_add(hashtable, node, key) \
+  hlist_add_head(node, &hashtable[hash_min(key, HASH_BITS(hashtable))])
+
+#define hash_del(node) hlist_del_init(node)
+
+#define hash_for_each_possible(name, obj, member, key)                     \
+  for (obj = hlist_entry_safe(name[hash_min(key, HASH_BITS(name))].first, \
+                              typeof(*(obj)), member);                     \
+       obj;                                                                \
+       obj = hlist_entry_safe((obj)->member.next, typeof(*(obj)), member))
+
+#define hash_for_each_possible_safe(name, obj, tmp, member, key)           \
+  for (obj = hlist_entry_safe(name[hash_min(key, HASH_BITS(name))].first, \
+                              typeof(*(obj)), member);                     \
+       obj && ({ tmp = (obj)->member.next; 1; });                          \
+       obj = hlist_entry_safe(tmp, typeof(*(obj)), member))
+
+// linux/slab.h and linux/vmalloc.h on top of malloc
+struct kmem_cache {
+  size_t size;
+};
+
+static inline struct kmem_cache* kmem_cache_create(const char* name,
+                                                   size_t size, size_t align,
+                                                   unsigned long flags,
+                                                   void (*ctor)(void*)) {
+  struct kmem_cache* cache = malloc(sizeof(struct kmem_cache));
+  if (cache != NULL) {
+    cache->size = size;
+  }
+
+  return cache;
+}
+
+static inline void kmem_cache_destroy(struct kmem_cache* cache) {
+  free(cache);
+}
+
+static inline void* kmem_cache_alloc(struct kmem_cache* cache, int flags) {
+  return malloc(cache->size);
+}
+
+static inline void kmem_cache_free(struct kmem_cache* cache, void* obj) {
+  free(obj);
+}
+
+#define vmalloc(size) malloc(size)
+#define vfree(ptr) free(ptr)
+
+#endif /* _KSHIM_H */
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "modlist_core.h"
+
+// Userspace benchmark of the modlist core. It runs the same add_item,
+// remove_item and parse_batch as the module, so the hot paths can be
+// profiled with perf without loading anything:
+//
+//   ./modlist_bench [-s] [size ...]
+//   perf record -g ./modlist_bench 1000000
+//
+// -s enables sorted mode. Prints one line per operation and list size
+
+// Same staging size as the write path of the module
+#define WRITE_CHUNK_LEN 4096
+
+// Values per generated `add` line
+#define VALUES_PER_LINE 16
+
+static const int default_sizes[] = {1000, 10000, 100000, 1000000};
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void report(const char* op, int size, int ops, long long ns) {
+  printf("op=%s size=%i ops=%i total_ns=%lld ns_per_op=%lld\n", op, size, ops,
+         ns, ns / (ops > 0 ? ops : 1));
+}
+
+static int count_op(list_cmd_t cmd, const int* args, void* ctx) {
+  int* count = ctx;
+  (*count)++;
+  return 0;
+}
+
+// Text with `size` values spread on `add` lines, as a writer would send it
+static char* build_commands(const int* values, int size, size_t* len) {
+  int i;
+  size_t pos = 0;
+  char* text = malloc((size_t)size * 13 + (size / VALUES_PER_LINE + 1) * 5);
+
+  if (text == NULL) {
+    return NULL;
+  }
+
+  for (i = 0; i < size; i++) {
+    if (i % VALUES_PER_LINE == 0) {
+      pos += sprintf(text + pos, (i == 0) ? "add" : "\nadd");
+    }
+    pos += sprintf(text + pos, " %i", values[i]);
+  }
+  text[pos++] = '\n';
+
+  *len = pos;
+  return text;
+}
+
+// Parse the commands in chunks, like modlist_write does
+static void bench_parse(const int* values, int size) {
+  int count = 0;
+  size_t len;
+  size_t done;
+  long long start;
+  list_parser_t parser = {.cmd = CMD_NONE};
+  char* text = build_commands(values, size, &len);
+
+  if (text == NULL) {
+    return;
+  }
+
+  start = now_ns();
+  for (done = 0; done < len; done += WRITE_CHUNK_LEN) {
+    parse_batch(&parser, text + done,
+                (len - done < WRITE_CHUNK_LEN) ? len - done : WRITE_CHUNK_LEN,
+                count_op, &count);
+  }
+  parse_end(&parser, count_op, &count);
+  report("parse", size, count, now_ns() - start);
+
+  free(text);
+}
+
+static void bench_add(const int* values, int size) {
+  int i;
+  long long start = now_ns();
+
+  for (i = 0; i < size; i++) {
+    add_item(llist, values[i]);
+  }
+  report("add", size, size, now_ns() - start);
+}
+
+// Format the whole list as modlist_seq_show does, one page at a time
+static void bench_print(int size) {
+  int count = 0;
+  size_t pos = 0;
+  long long start;
+  char page[WRITE_CHUNK_LEN];
+  list_item_t* item = NULL;
+
+  start = now_ns();
+  list_for_each_entry(item, llist, links) {
+    if (pos > sizeof(page) - 16) {
+      pos = 0;
+    }
+
+    pos += sprintf(page + pos, "%i\n", item->data);
+    count++;
+  }
+  report("print", size, count, now_ns() - start);
+}
+
+// Remove a tenth of the values, picked at random
+static void bench_remove(const int* values, int size) {
+  int i;
+  int removes = (size >= 10) ? size / 10 : 1;
+  long long start;
+  int* picked = malloc(removes * sizeof(int));
+
+  if (picked == NULL) {
+    return;
+  }
+
+  for (i = 0; i < removes; i++) {
+    picked[i] = values[rand() % size];
+  }
+
+  start = now_ns();
+  for (i = 0; i < removes; i++) {
+    remove_item(llist, picked[i]);
+  }
+  report("remove", size, removes, now_ns() - start);
+
+  free(picked);
+}
+
+static void bench_size(int size) {
+  int i;
+  int* values = malloc(size * sizeof(int));
+
+  if (values == NULL) {
+    fprintf(stderr, "Can't allocate %i values\n", size);
+    return;
+  }
+
+  for (i = 0; i < size; i++) {
+    values[i] = rand();
+  }
+
+  bench_parse(values, size);
+  bench_add(values, size);
+  bench_print(size);
+  bench_remove(values, size);
+  cleanup(llist);
+
+  free(values);
+}
+
+int main(int argc, char* argv[]) {
+  int i;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s")) != -1) {
+    switch (opt) {
+    case 's':
+      sorted = true;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-s] [size ...]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (item_cache_create() != 0) {
+    return 1;
+  }
+
+  llist = list_head_init();
+  INIT_LIST_HEAD(llist);
+  srand(1);
+
+  if (optind == argc) {
+    for (i = 0; i < ARRAY_SIZE(default_sizes); i++) {
+      bench_size(default_sizes[i]);
+    }
+  } else {
+    for (i = optind; i < argc; i++) {
+      bench_size(atoi(argv[i]));
+    }
+  }
+
+  vfree(llist);
+  item_cache_destroy();
+  return 0;
+}
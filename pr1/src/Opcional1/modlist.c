@@ -2,35 +2,59 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/proc_fs.h>
+#include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 
+#define CREATE_TRACE_POINTS
+#include "modlist_trace.h"
+
 #define READ_BUF_LEN 256
 
 MODULE_LICENSE("GPL");
 
 struct list_head* llist;
-typedef struct list_item_t {
 #ifdef CHARLIST
-  char* data;
-  size_t data_len;
+// The string is stored inline right after the links, without a trailing
+// '\0'. Nodes are sized to the string, see item_caches
+typedef struct list_item_t {
+  struct list_head links;
+  u16 data_len;
+  char data[];
+} list_item_t;
+
+// Nodes come from slabs of 32, 64, ... 512 bytes, the smallest one that
+// fits the string is used. A node costs a few dozen bytes instead of two
+// vmalloc'd pages, and nodes of similar length share the same pages
+#define ITEM_SIZE_CLASSES 5
+#define ITEM_MIN_SIZE 32
+
+static struct kmem_cache* item_caches[ITEM_SIZE_CLASSES];
+static const char* item_cache_names[ITEM_SIZE_CLASSES] = {
+  "modlist_str32", "modlist_str64", "modlist_str128", "modlist_str256",
+  "modlist_str512"
+};
 #else
+typedef struct list_item_t {
   int data;
-#endif
   struct list_head links;
 } list_item_t;
+#endif
 
 static struct proc_dir_entry* proc_entry;
 
 struct list_head* list_head_init(void);
-struct list_item_t* list_item_init(struct list_item_t data);
 
 #ifdef CHARLIST
-char* list_item_data_init(char* data, size_t len);
+int item_caches_init(void);
+void item_caches_destroy(void);
+int item_size_class(size_t len);
+struct list_item_t* list_item_data_init(char* data, size_t len);
 void add_item(struct list_head* list, char* data, size_t len);
 bool match_item(list_item_t* item, char* data, size_t len);
 void remove_item(struct list_head* list, char* data, size_t len);
 #else
+struct list_item_t* list_item_init(struct list_item_t data);
 void add_item(struct list_head* list, int data);
 bool match_item(list_item_t* item, int data);
 void remove_item(struct list_head* list, int data);
@@ -55,8 +79,6 @@ static ssize_t modlist_read(struct file* fd, char __user* buf, size_t len,
   int to_copy;
   char own_buffer[READ_BUF_LEN];
 
-  printk(KERN_ALERT "Modlist: Calling read\n");
-
   if (len == 0) {
     return 0;
   }
@@ -66,8 +88,8 @@ static ssize_t modlist_read(struct file* fd, char __user* buf, size_t len,
   }
 
   size = print_list(llist, own_buffer);
+  trace_modlist_read(size);
   if (size <= 0) {
-    printk(KERN_INFO "Modlist: Empty list\n");
     return 0;
   }
 
@@ -94,7 +116,7 @@ static ssize_t modlist_write(struct file* fd, const char __user* buf,
     return -EFAULT;
   }
 
-  printk(KERN_ALERT "Modlist: Calling write\n");
+  trace_modlist_write(len);
 
   own_buffer[len] = '\0';
 
@@ -135,11 +157,29 @@ static const struct file_operations proc_entry_fops = {.read = modlist_read,
                                                        .write = modlist_write};
 
 int init_modlist_module(void) {
+#ifdef CHARLIST
+  if (item_caches_init() != 0) {
+    printk(KERN_INFO "Modlist: Can't create item caches\n");
+    return -ENOMEM;
+  }
+#endif
+
   llist = list_head_init();
+  if (llist == NULL) {
+#ifdef CHARLIST
+    item_caches_destroy();
+#endif
+    printk(KERN_INFO "Modlist: Can't allocate the list\n");
+    return -ENOMEM;
+  }
   INIT_LIST_HEAD(llist);
 
   proc_entry = proc_create("modlist", 0666, NULL, &proc_entry_fops);
   if (proc_entry == NULL) {
+    vfree(llist);
+#ifdef CHARLIST
+    item_caches_destroy();
+#endif
     printk(KERN_INFO "Modlist: Can't create /proc entry\n");
     return -ENOMEM;
   } else {
@@ -150,10 +190,14 @@ int init_modlist_module(void) {
 }
 
 void exit_modlist_module(void) {
+  // Waits for in-flight writes, which may still use the item caches
+  remove_proc_entry("modlist", NULL);
+
   cleanup(llist);
   vfree(llist);
-
-  remove_proc_entry("modlist", NULL);
+#ifdef CHARLIST
+  item_caches_destroy();
+#endif
 
   printk(KERN_INFO "Modlist: Module unloaded.\n");
 }
@@ -166,11 +210,15 @@ struct list_head* list_head_init(void) {
   struct list_head* head;
 
   head = (struct list_head*)vmalloc((sizeof(struct list_head)));
+  if (head == NULL) {
+    return NULL;
+  }
   memset(head, 0, sizeof(struct list_head));
 
   return (struct list_head*)head;
 }
 
+#ifndef CHARLIST
 struct list_item_t* list_item_init(struct list_item_t data) {
   struct list_item_t* item;
   item = (struct list_item_t*)vmalloc((sizeof(struct list_item_t)));
@@ -178,6 +226,7 @@ struct list_item_t* list_item_init(struct list_item_t data) {
   memcpy(item, &data, sizeof(struct list_item_t));
   return (struct list_item_t*)item;
 }
+#endif
 
 int print_list(struct list_head* list, char* buf) {
   int buf_len = 0;
@@ -189,7 +238,8 @@ int print_list(struct list_head* list, char* buf) {
   list_for_each(cur_node, list) {
     item = list_entry(cur_node, struct list_item_t, links);
 #ifdef CHARLIST
-    read_bytes = snprintf(buf, (item->data_len + 1), "%s\n", item->data);
+    memcpy(buf, item->data, item->data_len);
+    read_bytes = item->data_len;
 #else
     read_bytes = sprintf(buf, "%i\n", item->data);
 #endif
@@ -249,19 +299,72 @@ int scanremove(const char* buffer, int* container) {
 
 #ifdef CHARLIST
 
-char* list_item_data_init(char* data, size_t len) {
-  char* dyn_data;
-  dyn_data = (char *)vmalloc(len);
-  memset(dyn_data, 0, len);
-  memcpy(dyn_data, data, len);
-  return (char *) dyn_data;
+int item_caches_init(void) {
+  int i;
+
+  for (i = 0; i < ITEM_SIZE_CLASSES; i++) {
+    item_caches[i] = kmem_cache_create(item_cache_names[i],
+                                       ITEM_MIN_SIZE << i, 0, 0, NULL);
+    if (item_caches[i] == NULL) {
+      item_caches_destroy();
+      return -ENOMEM;
+    }
+  }
+
+  return 0;
+}
+
+void item_caches_destroy(void) {
+  int i;
+
+  for (i = 0; i < ITEM_SIZE_CLASSES; i++) {
+    if (item_caches[i] != NULL) {
+      kmem_cache_destroy(item_caches[i]);
+      item_caches[i] = NULL;
+    }
+  }
+}
+
+// Smallest size class holding a node with `len` bytes of data, or
+// ITEM_SIZE_CLASSES if the string is too long for any of them
+int item_size_class(size_t len) {
+  int class = 0;
+  size_t size = offsetof(struct list_item_t, data) + len;
+
+  while (class < ITEM_SIZE_CLASSES && (ITEM_MIN_SIZE << class) < size) {
+    class++;
+  }
+
+  return class;
+}
+
+struct list_item_t* list_item_data_init(char* data, size_t len) {
+  int class;
+  struct list_item_t* item;
+
+  class = item_size_class(len);
+  if (class == ITEM_SIZE_CLASSES) {
+    return NULL;
+  }
+
+  item = kmem_cache_alloc(item_caches[class], GFP_KERNEL);
+  if (item == NULL) {
+    return NULL;
+  }
+
+  item->data_len = len;
+  memcpy(item->data, data, len);
+  return item;
 }
 
 void add_item(struct list_head* list, char* data, size_t len) {
-  char* dyn_data;
   struct list_item_t* new_item;
-  dyn_data = list_item_data_init(data, len);
-  new_item = list_item_init((struct list_item_t){.data = dyn_data, .data_len = len});
+  new_item = list_item_data_init(data, len);
+  if (new_item == NULL) {
+    printk(KERN_INFO "Modlist: Can't store a string of %zu bytes\n", len);
+    return;
+  }
+
   list_add_tail(&new_item->links, list);
 }
 
@@ -282,7 +385,7 @@ void cleanup(struct list_head* list) {
   list_for_each_safe(cur_node, aux_storage, llist) {
     item = list_entry(cur_node, struct list_item_t, links);
     list_del(cur_node);
-    vfree(item);
+    free_item(item);
   }
 }
 
@@ -311,7 +414,7 @@ void remove_item(struct list_head* list, int data) {
 #ifdef CHARLIST
 bool match_item(list_item_t* item, char* data, size_t len) {
   if (item->data_len == len) {
-    return (0 == strncmp(item->data, data, item->data_len));
+    return (0 == memcmp(item->data, data, item->data_len));
   }
 
   return false;
@@ -324,9 +427,10 @@ bool match_item(list_item_t* item, int data) {
 
 void free_item(list_item_t* item) {
 #ifdef CHARLIST
-  vfree(item->data);
-#endif
+  kmem_cache_free(item_caches[item_size_class(item->data_len)], item);
+#else
   vfree(item);
+#endif
 }
 
 module_init(init_modlist_module);
@@ -0,0 +1,47 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM modlist
+
+#if !defined(_MODLIST_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MODLIST_TRACE_H
+
+// Tracepoints of /proc/modlist, all of them off by default. Enable them
+// through tracefs, for instance:
+//
+//   echo 1 > /sys/kernel/debug/tracing/events/modlist/enable
+//   cat /sys/kernel/debug/tracing/trace_pipe
+
+#include <linux/tracepoint.h>
+
+// A read() returning `size` bytes of the list, 0 when it's empty
+TRACE_EVENT(modlist_read,
+  TP_PROTO(int size),
+  TP_ARGS(size),
+  TP_STRUCT__entry(
+    __field(int, size)
+  ),
+  TP_fast_assign(
+    __entry->size = size;
+  ),
+  TP_printk("size=%d", __entry->size)
+);
+
+// A write() of a `len` bytes command
+TRACE_EVENT(modlist_write,
+  TP_PROTO(size_t len),
+  TP_ARGS(len),
+  TP_STRUCT__entry(
+    __field(size_t, len)
+  ),
+  TP_fast_assign(
+    __entry->len = len;
+  ),
+  TP_printk("len=%zu", __entry->len)
+);
+
+#endif /* _MODLIST_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE modlist_trace
+#include <trace/define_trace.h>
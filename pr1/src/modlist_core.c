@@ -0,0 +1,419 @@
+#ifdef __KERNEL__
+#include <linux/hashtable.h>
+#include <linux/limits.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#endif
+
+#include "modlist_core.h"
+
+// 2^16 buckets keep the chains short even with a million elements
+#define ITEM_HASH_BITS 16
+
+// Module parameter in the kernel, see modmain.c
+bool sorted;
+
+struct list_head* llist;
+unsigned long list_gen;
+unsigned long list_len;
+
+// Index of the list items keyed by value. Items are still linked in
+// insertion order through `links`, `hlinks` only speeds up lookups
+static DEFINE_HASHTABLE(item_table, ITEM_HASH_BITS);
+
+// Sorted mode only, the items ordered by value. Equal values keep their
+// insertion order. `links` follows the same order, so a range is found
+// through the tree and then walked on the list
+static struct rb_root item_tree = RB_ROOT;
+
+// Dedicated slab for the list nodes, shows up as `modlist_item`
+// in /proc/slabinfo
+static struct kmem_cache* item_cache;
+
+// Values taken by each command
+#define CMD_VARIADIC (-1)
+static const int cmd_arity[] = {
+  [CMD_NONE] = 0,
+  [CMD_ADD] = CMD_VARIADIC,
+  [CMD_REMOVE] = CMD_VARIADIC,
+  [CMD_CONTAINS] = CMD_VARIADIC,
+  [CMD_CLEANUP] = 0,
+  [CMD_RANGE] = CMD_BOUNDS,
+  [CMD_COUNT] = CMD_BOUNDS,
+  [CMD_MIN] = 0,
+  [CMD_MAX] = 0
+};
+
+int item_cache_create(void) {
+  item_cache = kmem_cache_create("modlist_item", sizeof(list_item_t), 0, 0,
+                                 NULL);
+  return (item_cache == NULL) ? -ENOMEM : 0;
+}
+
+void item_cache_destroy(void) {
+  kmem_cache_destroy(item_cache);
+}
+
+struct list_head* list_head_init(void) {
+  struct list_head* head;
+
+  head = (struct list_head*)vmalloc((sizeof(struct list_head)));
+  memset(head, 0, sizeof(struct list_head));
+
+  return (struct list_head*)head;
+}
+
+struct list_item_t* list_item_init(struct list_item_t data) {
+  struct list_item_t* item;
+  item = kmem_cache_alloc(item_cache, GFP_KERNEL);
+  if (item == NULL) {
+    return NULL;
+  }
+
+  memcpy(item, &data, sizeof(struct list_item_t));
+  return item;
+}
+
+// Hand-rolled replacement for sscanf("%i"), accepts an optional sign
+// followed by decimal digits
+int parse_int(const char* token, size_t len, int* container) {
+  size_t i = 0;
+  bool negative = false;
+  s64 value = 0;
+
+  if (len > 0 && (token[0] == '-' || token[0] == '+')) {
+    negative = (token[0] == '-');
+    i++;
+  }
+
+  if (i == len) {
+    return -EINVAL;
+  }
+
+  for (; i < len; i++) {
+    if (token[i] < '0' || token[i] > '9') {
+      return -EINVAL;
+    }
+
+    value = value * 10 + (token[i] - '0');
+    if (value > (s64)INT_MAX + 1) {
+      return -EINVAL;
+    }
+  }
+
+  value = negative ? -value : value;
+  if (value > INT_MAX) {
+    return -EINVAL;
+  }
+
+  *container = (int)value;
+  return 0;
+}
+
+list_cmd_t parse_keyword(const char* token, size_t len) {
+  if (len == 3 && memcmp(token, "add", 3) == 0) {
+    return CMD_ADD;
+  } else if (len == 6 && memcmp(token, "remove", 6) == 0) {
+    return CMD_REMOVE;
+  } else if (len == 8 && memcmp(token, "contains", 8) == 0) {
+    return CMD_CONTAINS;
+  } else if (len == 7 && memcmp(token, "cleanup", 7) == 0) {
+    return CMD_CLEANUP;
+  } else if (len == 5 && memcmp(token, "range", 5) == 0) {
+    return CMD_RANGE;
+  } else if (len == 5 && memcmp(token, "count", 5) == 0) {
+    return CMD_COUNT;
+  } else if (len == 3 && memcmp(token, "min", 3) == 0) {
+    return CMD_MIN;
+  } else if (len == 3 && memcmp(token, "max", 3) == 0) {
+    return CMD_MAX;
+  }
+
+  return CMD_NONE;
+}
+
+static int parse_token(list_parser_t* parser, const char* token, size_t len,
+                       list_op_fn fn, void* ctx) {
+  int ret;
+  int data;
+
+  // First token of a line, figure out the command
+  if (parser->cmd == CMD_NONE) {
+    parser->cmd = parse_keyword(token, len);
+    parser->nr_values = 0;
+    if (parser->cmd == CMD_NONE) {
+      return -EINVAL;
+    }
+
+    return (cmd_arity[parser->cmd] == 0) ? fn(parser->cmd, NULL, ctx) : 0;
+  }
+
+  // Too many values for the command
+  if (parser->nr_values == cmd_arity[parser->cmd]) {
+    return -EINVAL;
+  }
+
+  ret = parse_int(token, len, &data);
+  if (ret != 0) {
+    return ret;
+  }
+
+  // Bounds are passed on together at the end of the line
+  if (cmd_arity[parser->cmd] == CMD_BOUNDS) {
+    parser->bounds[parser->nr_values++] = data;
+    return 0;
+  }
+
+  parser->nr_values++;
+  return fn(parser->cmd, &data, ctx);
+}
+
+static inline bool is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline bool is_delimiter(char c) {
+  return c == '\n' || is_blank(c);
+}
+
+// Feed `len` bytes of commands to the tokenizer, calling `fn` for every
+// value found. A token that reaches the end of the buffer is kept in the
+// parser, as it may continue in the next one. Returns 0, or the first
+// error found
+int parse_batch(list_parser_t* parser, const char* buffer, size_t len,
+                list_op_fn fn, void* ctx) {
+  int ret;
+  size_t i = 0;
+  size_t start;
+
+  while (i < len) {
+    if (is_delimiter(buffer[i])) {
+      // Finish the token carried over from the previous buffer
+      if (parser->token_len > 0) {
+        ret = parse_token(parser, parser->token, parser->token_len, fn, ctx);
+        parser->token_len = 0;
+        if (ret != 0) {
+          return ret;
+        }
+      }
+
+      if (buffer[i] == '\n') {
+        ret = parse_eol(parser, fn, ctx);
+        if (ret != 0) {
+          return ret;
+        }
+      }
+
+      i++;
+      continue;
+    }
+
+    start = i;
+    while (i < len && !is_delimiter(buffer[i])) {
+      i++;
+    }
+
+    if (i == len || parser->token_len > 0) {
+      if (parser->token_len + (i - start) > MAX_TOKEN_LEN) {
+        return -EINVAL;
+      }
+
+      memcpy(parser->token + parser->token_len, buffer + start, i - start);
+      parser->token_len += i - start;
+    } else {
+      ret = parse_token(parser, buffer + start, i - start, fn, ctx);
+      if (ret != 0) {
+        return ret;
+      }
+    }
+  }
+
+  return 0;
+}
+
+// Terminates the current line, checking the command got all its values.
+// A range or count is passed on here, once both bounds are known
+int parse_eol(list_parser_t* parser, list_op_fn fn, void* ctx) {
+  list_cmd_t cmd = parser->cmd;
+
+  parser->cmd = CMD_NONE;
+  if (cmd == CMD_NONE || cmd_arity[cmd] == 0) {
+    return 0;
+  }
+
+  if (cmd_arity[cmd] == CMD_VARIADIC) {
+    return (parser->nr_values > 0) ? 0 : -EINVAL;
+  }
+
+  if (parser->nr_values != cmd_arity[cmd]) {
+    return -EINVAL;
+  }
+
+  return fn(cmd, parser->bounds, ctx);
+}
+
+// End of input, flush the carried token and terminate the last line
+int parse_end(list_parser_t* parser, list_op_fn fn, void* ctx) {
+  int ret = 0;
+
+  if (parser->token_len > 0) {
+    ret = parse_token(parser, parser->token, parser->token_len, fn, ctx);
+    parser->token_len = 0;
+  }
+
+  if (ret == 0) {
+    ret = parse_eol(parser, fn, ctx);
+  }
+
+  return ret;
+}
+
+int add_item(struct list_head* list, int data) {
+  struct list_item_t* new_item;
+  new_item = list_item_init((struct list_item_t){.data = data});
+  if (new_item == NULL) {
+    return -ENOMEM;
+  }
+
+  if (sorted) {
+    sorted_insert(list, new_item);
+    // Nodes before a cursor shift only if the new one isn't the last
+    if (new_item->links.next != list) {
+      list_gen++;
+    }
+  } else {
+    list_add_tail(&new_item->links, list);
+  }
+
+  hash_add(item_table, &new_item->hlinks, data);
+  list_len++;
+  return 0;
+}
+
+void cleanup(struct list_head* list) {
+  struct list_head* cur_node = NULL;
+  struct list_head* aux_storage = NULL;
+  struct list_item_t* item = NULL;
+
+  list_for_each_safe(cur_node, aux_storage, llist) {
+    item = list_entry(cur_node, struct list_item_t, links);
+    list_del(cur_node);
+    hash_del(&item->hlinks);
+    free_item(item);
+  }
+  item_tree = RB_ROOT;
+  list_len = 0;
+  list_gen++;
+}
+
+void remove_item(struct list_head* list, int data) {
+  struct hlist_node* aux_storage = NULL;
+  struct list_item_t* item = NULL;
+
+  hash_for_each_possible_safe(item_table, item, aux_storage, hlinks, data) {
+    if (match_item(item, data)) {
+      hash_del(&item->hlinks);
+      list_del(&item->links);
+      if (sorted) {
+        rb_erase(&item->rb, &item_tree);
+      }
+      free_item(item);
+      list_len--;
+      list_gen++;
+    }
+  }
+}
+
+bool contains_item(struct list_head* list, int data) {
+  bool found = false;
+  struct list_item_t* item = NULL;
+
+  hash_for_each_possible(item_table, item, hlinks, data) {
+    if (match_item(item, data)) {
+      found = true;
+      break;
+    }
+  }
+
+  return found;
+}
+
+// Links `new_item` into the tree and into the list right after the last
+// item not greater than it, keeping both in the same order
+void sorted_insert(struct list_head* list, list_item_t* new_item) {
+  struct rb_node** link = &item_tree.rb_node;
+  struct rb_node* parent = NULL;
+  list_item_t* prev = NULL;
+  list_item_t* item = NULL;
+
+  while (*link != NULL) {
+    parent = *link;
+    item = rb_entry(parent, list_item_t, rb);
+    if (new_item->data < item->data) {
+      link = &parent->rb_left;
+    } else {
+      prev = item;
+      link = &parent->rb_right;
+    }
+  }
+
+  rb_link_node(&new_item->rb, parent, link);
+  rb_insert_color(&new_item->rb, &item_tree);
+  list_add(&new_item->links, (prev != NULL) ? &prev->links : list);
+}
+
+// First item not lower than `data`, or NULL
+list_item_t* sorted_lower_bound(int data) {
+  struct rb_node* node = item_tree.rb_node;
+  list_item_t* found = NULL;
+  list_item_t* item = NULL;
+
+  while (node != NULL) {
+    item = rb_entry(node, list_item_t, rb);
+    if (item->data >= data) {
+      found = item;
+      node = node->rb_left;
+    } else {
+      node = node->rb_right;
+    }
+  }
+
+  return found;
+}
+
+// Node following `node` within the range query, or NULL past its end
+struct list_head* range_next(list_query_t* query, struct list_head* node) {
+  node = node->next;
+  if (node == llist || list_entry(node, list_item_t, links)->data > query->hi) {
+    return NULL;
+  }
+
+  return node;
+}
+
+unsigned int count_range(int lo, int hi) {
+  unsigned int count = 0;
+  list_item_t* item = sorted_lower_bound(lo);
+
+  if (item == NULL) {
+    return 0;
+  }
+
+  list_for_each_entry_from(item, llist, links) {
+    if (item->data > hi) {
+      break;
+    }
+    count++;
+  }
+
+  return count;
+}
+
+bool match_item(list_item_t* item, int data) {
+  return item->data == data;
+}
+
+void free_item(list_item_t* item) {
+  kmem_cache_free(item_cache, item);
+}
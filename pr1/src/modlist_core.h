@@ -0,0 +1,122 @@
+#ifndef _MODLIST_CORE_H
+#define _MODLIST_CORE_H
+
+// List logic shared by the module and by the userspace benchmark in
+// pr1/bench, which builds it against kshim.h instead of the kernel headers
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/rbtree.h>
+#include <linux/types.h>
+#else
+#include "kshim.h"
+#endif
+
+// Longest token we may carry from one chunk to the next, enough for any
+// keyword or for "-2147483648"
+#define MAX_TOKEN_LEN 16
+
+typedef struct list_item_t {
+  int data;
+  struct list_head links;
+  struct hlist_node hlinks;
+  struct rb_node rb;
+} list_item_t;
+
+// Commands accepted by modlist_write. A write holds any number of
+// newline-separated commands, `add`, `remove` and `contains` take one or
+// more values each:
+//
+//   add 1 2 3
+//   remove 2
+//   contains 1 3
+//   cleanup
+//
+// `contains` doesn't fail the write, the next read() on the same file
+// returns 1 if every value it checked was in the list and 0 otherwise.
+// In sorted mode there are also queries, answered the same way:
+//
+//   range 10 20    values in [10, 20], in order
+//   count 10 20    number of values in [10, 20]
+//   min
+//   max
+typedef enum list_cmd_t {
+  CMD_NONE = 0,
+  CMD_ADD,
+  CMD_REMOVE,
+  CMD_CONTAINS,
+  CMD_CLEANUP,
+  CMD_RANGE,
+  CMD_COUNT,
+  CMD_MIN,
+  CMD_MAX
+} list_cmd_t;
+
+// Values taken by a range or count
+#define CMD_BOUNDS 2
+
+// Tokenizer state, `cmd` is CMD_NONE at the start of a line. A command
+// may be split across several writes, `token` holds the bytes of a token
+// cut at the end of the previous chunk
+typedef struct list_parser_t {
+  list_cmd_t cmd;
+  int nr_values;
+  // Values of a range or count, passed on once the line ends
+  int bounds[CMD_BOUNDS];
+  size_t token_len;
+  char token[MAX_TOKEN_LEN];
+} list_parser_t;
+
+// Called by parse_batch for every command found. `args` points to the
+// value, to both bounds of a range or count, or is NULL for commands
+// without values
+typedef int (*list_op_fn)(list_cmd_t cmd, const int* args, void* ctx);
+
+// Query set by the last contains, range, count, min or max written to an
+// open file. read() on that file returns its result instead of the whole
+// list
+typedef struct list_query_t {
+  list_cmd_t cmd;
+  int lo;
+  int hi;
+  // contains, whether every value of the write was found
+  bool found;
+} list_query_t;
+
+extern bool sorted;
+extern struct list_head* llist;
+
+// Bumped every time a node is unlinked, or inserted anywhere but the tail
+// in sorted mode, invalidating all cached cursors
+extern unsigned long list_gen;
+
+// Number of items in the list
+extern unsigned long list_len;
+
+int item_cache_create(void);
+void item_cache_destroy(void);
+
+struct list_head* list_head_init(void);
+struct list_item_t* list_item_init(struct list_item_t data);
+
+int add_item(struct list_head* list, int data);
+bool match_item(list_item_t* item, int data);
+void remove_item(struct list_head* list, int data);
+bool contains_item(struct list_head* list, int data);
+void free_item(list_item_t* item);
+void cleanup(struct list_head* list);
+
+void sorted_insert(struct list_head* list, list_item_t* new_item);
+list_item_t* sorted_lower_bound(int data);
+struct list_head* range_next(list_query_t* query, struct list_head* node);
+unsigned int count_range(int lo, int hi);
+
+int parse_int(const char* token, size_t len, int* container);
+list_cmd_t parse_keyword(const char* token, size_t len);
+int parse_batch(list_parser_t* parser, const char* buffer, size_t len,
+                list_op_fn fn, void* ctx);
+int parse_eol(list_parser_t* parser, list_op_fn fn, void* ctx);
+int parse_end(list_parser_t* parser, list_op_fn fn, void* ctx);
+
+#endif /* _MODLIST_CORE_H */
@@ -0,0 +1,31 @@
+#ifndef _MODLIST_IOCTL_H
+#define _MODLIST_IOCTL_H
+
+// Binary interface of /proc/modlist, shared by the module and its users.
+// Values travel as packed arrays of int32, skipping the text formatting
+// and parsing of read() / write()
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+struct modlist_ioc_values {
+  // User pointer to an array of `count` int32 values
+  __u64 values;
+  // ADD / REMOVE: number of values in the array
+  // DUMP: capacity of the array, on return the length of the list
+  __u32 count;
+  __u32 pad;
+};
+
+#define MODLIST_IOC_MAGIC 'm'
+
+// Add every value in the array, returns the number of values added
+#define MODLIST_IOC_ADD _IOW(MODLIST_IOC_MAGIC, 1, struct modlist_ioc_values)
+
+// Remove every value in the array, returns the number of values processed
+#define MODLIST_IOC_REMOVE _IOW(MODLIST_IOC_MAGIC, 2, struct modlist_ioc_values)
+
+// Copy the list in order, returns the number of values copied
+#define MODLIST_IOC_DUMP _IOWR(MODLIST_IOC_MAGIC, 3, struct modlist_ioc_values)
+
+#endif /* _MODLIST_IOCTL_H */
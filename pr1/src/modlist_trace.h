@@ -0,0 +1,83 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM modlist
+
+#if !defined(_MODLIST_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MODLIST_TRACE_H
+
+// Tracepoints of /proc/modlist, all of them off by default. Enable them
+// through tracefs, for instance:
+//
+//   echo 1 > /sys/kernel/debug/tracing/events/modlist/modlist_op/enable
+//   cat /sys/kernel/debug/tracing/trace_pipe
+
+#include <linux/tracepoint.h>
+
+#include "modlist_core.h"
+
+TRACE_DEFINE_ENUM(CMD_ADD);
+TRACE_DEFINE_ENUM(CMD_REMOVE);
+TRACE_DEFINE_ENUM(CMD_CONTAINS);
+TRACE_DEFINE_ENUM(CMD_CLEANUP);
+TRACE_DEFINE_ENUM(CMD_RANGE);
+TRACE_DEFINE_ENUM(CMD_COUNT);
+TRACE_DEFINE_ENUM(CMD_MIN);
+TRACE_DEFINE_ENUM(CMD_MAX);
+
+#define show_list_cmd(cmd)                                             \
+  __print_symbolic(cmd, {CMD_ADD, "add"}, {CMD_REMOVE, "remove"},     \
+                   {CMD_CONTAINS, "contains"}, {CMD_CLEANUP, "cleanup"}, \
+                   {CMD_RANGE, "range"}, {CMD_COUNT, "count"},        \
+                   {CMD_MIN, "min"}, {CMD_MAX, "max"})
+
+// A read() starting at `pos`
+TRACE_EVENT(modlist_read,
+  TP_PROTO(loff_t pos),
+  TP_ARGS(pos),
+  TP_STRUCT__entry(
+    __field(loff_t, pos)
+  ),
+  TP_fast_assign(
+    __entry->pos = pos;
+  ),
+  TP_printk("pos=%lld", __entry->pos)
+);
+
+// A write() of `len` bytes of commands
+TRACE_EVENT(modlist_write,
+  TP_PROTO(size_t len),
+  TP_ARGS(len),
+  TP_STRUCT__entry(
+    __field(size_t, len)
+  ),
+  TP_fast_assign(
+    __entry->len = len;
+  ),
+  TP_printk("len=%zu", __entry->len)
+);
+
+// A command applied to the list, `value` is 0 for commands without one
+// and the lower bound for range and count
+TRACE_EVENT(modlist_op,
+  TP_PROTO(list_cmd_t op, int value, unsigned long len),
+  TP_ARGS(op, value, len),
+  TP_STRUCT__entry(
+    __field(list_cmd_t, op)
+    __field(int, value)
+    __field(unsigned long, len)
+  ),
+  TP_fast_assign(
+    __entry->op = op;
+    __entry->value = value;
+    __entry->len = len;
+  ),
+  TP_printk("op=%s value=%d len=%lu", show_list_cmd(__entry->op),
+            __entry->value, __entry->len)
+);
+
+#endif /* _MODLIST_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE modlist_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,484 @@
+#include <asm-generic/uaccess.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "modlist_core.h"
+#include "modlist_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "modlist_trace.h"
+
+// Writes and bulk ioctls are staged in chunks of this size
+#define WRITE_CHUNK_LEN PAGE_SIZE
+
+MODULE_LICENSE("GPL");
+
+// With `sorted` set the list is kept ordered by value and the range
+// queries are enabled
+module_param(sorted, bool, 0000);
+MODULE_PARM_DESC(sorted, "Keep the list ordered by value");
+
+// Position of the last node handed out by the seq_file iterator, so that
+// consecutive read() calls resume where the previous one stopped instead
+// of walking the list from the head again
+typedef struct list_cursor_t {
+  struct list_head* node;
+  loff_t pos;
+  unsigned long gen;
+} list_cursor_t;
+
+// Outcome of the commands applied by one write
+typedef struct list_batch_t {
+  list_query_t query;
+} list_batch_t;
+
+// Per open file state, reachable through the seq_file in private_data
+typedef struct list_private_t {
+  list_cursor_t cursor;
+  list_parser_t parser;
+  list_query_t query;
+  // Staging buffer for writes and ioctls, allocated on first use
+  char* chunk;
+  struct mutex lock;
+} list_private_t;
+
+static struct proc_dir_entry* proc_entry;
+
+// Node at `pos` within a range query, or NULL past its end
+static struct list_head* range_start(list_query_t* query, loff_t pos) {
+  list_item_t* item = sorted_lower_bound(query->lo);
+  struct list_head* node = NULL;
+
+  if (item != NULL && item->data <= query->hi) {
+    node = &item->links;
+  }
+
+  while (node != NULL && pos-- > 0) {
+    node = range_next(query, node);
+  }
+
+  return node;
+}
+
+static void* modlist_seq_start(struct seq_file* m, loff_t* pos) {
+  list_private_t* priv = m->private;
+  list_cursor_t* cursor = &priv->cursor;
+
+  trace_modlist_read(*pos);
+
+  // contains, count, min and max answer with a single line
+  if (priv->query.cmd != CMD_NONE && priv->query.cmd != CMD_RANGE) {
+    return ((*pos) == 0) ? SEQ_START_TOKEN : NULL;
+  }
+
+  // Resume from the cached node if nothing was removed since we stored it
+  if (cursor->node != NULL && cursor->pos == (*pos) &&
+      cursor->gen == list_gen) {
+    return cursor->node;
+  }
+
+  if (priv->query.cmd == CMD_RANGE) {
+    cursor->node = range_start(&priv->query, *pos);
+  } else {
+    cursor->node = seq_list_start(llist, *pos);
+  }
+
+  cursor->pos = *pos;
+  cursor->gen = list_gen;
+  return cursor->node;
+}
+
+static void* modlist_seq_next(struct seq_file* m, void* v, loff_t* pos) {
+  list_private_t* priv = m->private;
+  list_cursor_t* cursor = &priv->cursor;
+
+  if (v == SEQ_START_TOKEN) {
+    ++(*pos);
+    return NULL;
+  }
+
+  if (priv->query.cmd == CMD_RANGE) {
+    cursor->node = range_next(&priv->query, v);
+    ++(*pos);
+  } else {
+    cursor->node = seq_list_next(v, llist, pos);
+  }
+
+  cursor->pos = *pos;
+  return cursor->node;
+}
+
+static void modlist_seq_stop(struct seq_file* m, void* v) {}
+
+static void show_query(struct seq_file* m, list_query_t* query) {
+  switch (query->cmd) {
+  case CMD_CONTAINS:
+    seq_printf(m, "%d\n", query->found);
+    break;
+  case CMD_COUNT:
+    seq_printf(m, "%u\n", count_range(query->lo, query->hi));
+    break;
+  case CMD_MIN:
+    if (!list_empty(llist)) {
+      seq_printf(m, "%i\n", list_first_entry(llist, list_item_t, links)->data);
+    }
+    break;
+  case CMD_MAX:
+    if (!list_empty(llist)) {
+      seq_printf(m, "%i\n", list_last_entry(llist, list_item_t, links)->data);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+static int modlist_seq_show(struct seq_file* m, void* v) {
+  list_private_t* priv = m->private;
+  struct list_item_t* item;
+
+  if (v == SEQ_START_TOKEN) {
+    show_query(m, &priv->query);
+    return 0;
+  }
+
+  item = list_entry(v, struct list_item_t, links);
+  seq_printf(m, "%i\n", item->data);
+  return 0;
+}
+
+static const struct seq_operations modlist_seq_ops = {
+  .start = modlist_seq_start,
+  .next = modlist_seq_next,
+  .stop = modlist_seq_stop,
+  .show = modlist_seq_show
+};
+
+static int modlist_open(struct inode* inode, struct file* fd) {
+  list_private_t* priv;
+
+  priv = __seq_open_private(fd, &modlist_seq_ops, sizeof(list_private_t));
+  if (priv == NULL) {
+    return -ENOMEM;
+  }
+
+  mutex_init(&priv->lock);
+  return 0;
+}
+
+// Queries need the tree, they are rejected unless loaded in sorted mode
+static int check_op(list_cmd_t cmd, const int* args, void* ctx) {
+  if (cmd >= CMD_RANGE && !sorted) {
+    return -EINVAL;
+  }
+
+  return 0;
+}
+
+static int apply_op(list_cmd_t cmd, const int* args, void* ctx) {
+  int ret;
+  list_batch_t* batch = ctx;
+
+  switch (cmd) {
+  case CMD_ADD:
+    ret = add_item(llist, args[0]);
+    if (ret != 0) {
+      return ret;
+    }
+    break;
+  case CMD_REMOVE:
+    remove_item(llist, args[0]);
+    break;
+  case CMD_CONTAINS:
+    // Every contains of the write makes up a single answer
+    if (batch->query.cmd != CMD_CONTAINS) {
+      batch->query = (list_query_t){.cmd = CMD_CONTAINS, .found = true};
+    }
+
+    if (!contains_item(llist, args[0])) {
+      batch->query.found = false;
+    }
+    break;
+  case CMD_CLEANUP:
+    cleanup(llist);
+    break;
+  case CMD_RANGE:
+  case CMD_COUNT:
+    batch->query = (list_query_t){.cmd = cmd, .lo = args[0], .hi = args[1]};
+    break;
+  case CMD_MIN:
+  case CMD_MAX:
+    batch->query = (list_query_t){.cmd = cmd};
+    break;
+  default:
+    return -EINVAL;
+  }
+
+  trace_modlist_op(cmd, (args != NULL) ? args[0] : 0, list_len);
+  return 0;
+}
+
+// Caller must hold priv->lock
+static int alloc_chunk(list_private_t* priv) {
+  if (priv->chunk == NULL) {
+    priv->chunk = kmalloc(WRITE_CHUNK_LEN, GFP_KERNEL);
+    if (priv->chunk == NULL) {
+      return -ENOMEM;
+    }
+  }
+
+  return 0;
+}
+
+// Validate a chunk of commands and apply it. With `last` set, whatever
+// the parser still carries is applied too. A malformed chunk changes
+// nothing and resets the parser
+static int apply_chunk(list_parser_t* parser, const char* buffer, size_t len,
+                       bool last, list_batch_t* batch) {
+  int ret;
+  list_parser_t check = *parser;
+
+  ret = parse_batch(&check, buffer, len, check_op, NULL);
+  if (ret == 0 && last) {
+    ret = parse_end(&check, check_op, NULL);
+  }
+
+  if (ret != 0) {
+    *parser = (list_parser_t){.cmd = CMD_NONE};
+    return ret;
+  }
+
+  ret = parse_batch(parser, buffer, len, apply_op, batch);
+  if (ret == 0 && last) {
+    ret = parse_end(parser, apply_op, batch);
+  }
+
+  return ret;
+}
+
+// Commands may span several writes, so `cat` of a large command file works
+// no matter how it splits its writes. The input is consumed in place one
+// chunk at a time, lines cut at the end of a write are completed by the
+// next one or applied on close. A query or contains rewinds the file, so
+// the next read() returns its result
+static ssize_t modlist_write(struct file* fd, const char __user* buf,
+                             size_t len, loff_t* off) {
+
+  int ret = 0;
+  size_t chunk_len;
+  size_t consumed = 0;
+  list_batch_t batch = {.query = {.cmd = CMD_NONE}};
+  struct seq_file* m = fd->private_data;
+  list_private_t* priv = m->private;
+
+  trace_modlist_write(len);
+
+  mutex_lock(&priv->lock);
+
+  ret = alloc_chunk(priv);
+  if (ret != 0) {
+    goto out;
+  }
+
+  while (consumed < len) {
+    chunk_len = min_t(size_t, len - consumed, WRITE_CHUNK_LEN);
+    if (copy_from_user(priv->chunk, buf + consumed, chunk_len)) {
+      ret = -EFAULT;
+      goto out;
+    }
+
+    ret = apply_chunk(&priv->parser, priv->chunk, chunk_len, false, &batch);
+    if (ret != 0) {
+      goto out;
+    }
+
+    consumed += chunk_len;
+  }
+
+  if (batch.query.cmd != CMD_NONE) {
+    priv->query = batch.query;
+    priv->cursor.node = NULL;
+    *off = 0;
+  }
+
+  ret = len;
+
+out:
+  mutex_unlock(&priv->lock);
+  return ret;
+}
+
+// MODLIST_IOC_ADD / MODLIST_IOC_REMOVE, values are staged one chunk at a time
+static long ioctl_values(list_private_t* priv, unsigned int cmd,
+                         const s32 __user* values, u32 count) {
+  int ret;
+  u32 i;
+  u32 len;
+  u32 done = 0;
+  s32* chunk = (s32*)priv->chunk;
+
+  while (done < count) {
+    len = min_t(u32, count - done, WRITE_CHUNK_LEN / sizeof(s32));
+    if (copy_from_user(chunk, values + done, len * sizeof(s32))) {
+      return -EFAULT;
+    }
+
+    for (i = 0; i < len; i++) {
+      if (cmd == MODLIST_IOC_ADD) {
+        ret = add_item(llist, chunk[i]);
+        if (ret != 0) {
+          return ret;
+        }
+        trace_modlist_op(CMD_ADD, chunk[i], list_len);
+      } else {
+        remove_item(llist, chunk[i]);
+        trace_modlist_op(CMD_REMOVE, chunk[i], list_len);
+      }
+    }
+
+    done += len;
+  }
+
+  return done;
+}
+
+// MODLIST_IOC_DUMP, copies up to `count` values and stores the length of
+// the list in `total`
+static long ioctl_dump(list_private_t* priv, s32 __user* values, u32 count,
+                       u32* total) {
+  u32 len = 0;
+  u32 copied = 0;
+  u32 staged = 0;
+  s32* chunk = (s32*)priv->chunk;
+  struct list_item_t* item = NULL;
+
+  list_for_each_entry(item, llist, links) {
+    if (copied + staged < count) {
+      chunk[staged++] = item->data;
+    }
+
+    if (staged == WRITE_CHUNK_LEN / sizeof(s32)) {
+      if (copy_to_user(values + copied, chunk, staged * sizeof(s32))) {
+        return -EFAULT;
+      }
+
+      copied += staged;
+      staged = 0;
+    }
+
+    len++;
+  }
+
+  if (staged > 0) {
+    if (copy_to_user(values + copied, chunk, staged * sizeof(s32))) {
+      return -EFAULT;
+    }
+
+    copied += staged;
+  }
+
+  *total = len;
+  return copied;
+}
+
+static long modlist_ioctl(struct file* fd, unsigned int cmd,
+                          unsigned long arg) {
+  long ret;
+  struct modlist_ioc_values req;
+  struct modlist_ioc_values __user* user_req = (void __user*)arg;
+  struct seq_file* m = fd->private_data;
+  list_private_t* priv = m->private;
+
+  if (cmd != MODLIST_IOC_ADD && cmd != MODLIST_IOC_REMOVE &&
+      cmd != MODLIST_IOC_DUMP) {
+    return -ENOTTY;
+  }
+
+  if (copy_from_user(&req, user_req, sizeof(req))) {
+    return -EFAULT;
+  }
+
+  mutex_lock(&priv->lock);
+
+  ret = alloc_chunk(priv);
+  if (ret != 0) {
+    goto out;
+  }
+
+  if (cmd == MODLIST_IOC_DUMP) {
+    ret = ioctl_dump(priv, u64_to_user_ptr(req.values), req.count, &req.count);
+    if (ret >= 0 && put_user(req.count, &user_req->count)) {
+      ret = -EFAULT;
+    }
+  } else {
+    ret = ioctl_values(priv, cmd, u64_to_user_ptr(req.values), req.count);
+  }
+
+out:
+  mutex_unlock(&priv->lock);
+  return ret;
+}
+
+// Apply the last command if the writer didn't end it with a newline
+static int modlist_release(struct inode* inode, struct file* fd) {
+  list_batch_t batch = {.query = {.cmd = CMD_NONE}};
+  struct seq_file* m = fd->private_data;
+  list_private_t* priv = m->private;
+
+  if (priv->chunk != NULL) {
+    apply_chunk(&priv->parser, NULL, 0, true, &batch);
+    kfree(priv->chunk);
+  }
+
+  return seq_release_private(inode, fd);
+}
+
+static const struct file_operations proc_entry_fops = {
+  .open = modlist_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .write = modlist_write,
+  .unlocked_ioctl = modlist_ioctl,
+  .compat_ioctl = modlist_ioctl,
+  .release = modlist_release
+};
+
+int init_modlist_module(void) {
+  if (item_cache_create() != 0) {
+    printk(KERN_INFO "Modlist: Can't create item cache\n");
+    return -ENOMEM;
+  }
+
+  llist = list_head_init();
+  INIT_LIST_HEAD(llist);
+
+  proc_entry = proc_create("modlist", 0666, NULL, &proc_entry_fops);
+  if (proc_entry == NULL) {
+    vfree(llist);
+    item_cache_destroy();
+    printk(KERN_INFO "Modlist: Can't create /proc entry\n");
+    return -ENOMEM;
+  } else {
+    printk(KERN_INFO "Modlist: Module loaded\n");
+  }
+
+  return 0;
+}
+
+void exit_modlist_module(void) {
+  remove_proc_entry("modlist", NULL);
+
+  cleanup(llist);
+  vfree(llist);
+  item_cache_destroy();
+
+  printk(KERN_INFO "Modlist: Module unloaded.\n");
+}
+
+module_init(init_modlist_module);
+module_exit(exit_modlist_module);
@@ -0,0 +1,188 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <err.h>
+
+// Pushes `bytes` through a FIFO with one producer and one consumer
+// process, `chunk` bytes per read() / write(), and reports the context
+// switches both of them went through:
+//
+//   ./fifobench -f /proc/modfifo
+//   ./fifobench -f /dev/fifodev0 -b 16777216 -c 64
+//
+// Works with any FIFO, a `mkfifo` one gives a baseline to compare against
+
+#define DEFAULT_BYTES (4 << 20)
+#define DEFAULT_CHUNK 64
+
+char *nombre_programa = NULL;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void produce(const char* path_fifo, long bytes, int chunk) {
+    int fd_fifo;
+    long sent = 0;
+    char* buffer = malloc(chunk);
+
+    if (buffer == NULL) {
+        err(1, "malloc");
+    }
+    memset(buffer, 'x', chunk);
+
+    fd_fifo = open(path_fifo, O_WRONLY);
+    if (fd_fifo < 0) {
+        err(1, "%s", path_fifo);
+    }
+
+    while (sent < bytes) {
+        if (write(fd_fifo, buffer, chunk) != chunk) {
+            err(1, "Error when writing to the FIFO");
+        }
+        sent += chunk;
+    }
+
+    close(fd_fifo);
+    free(buffer);
+}
+
+static void consume(const char* path_fifo, long bytes, int chunk) {
+    int fd_fifo;
+    ssize_t rbytes;
+    long received = 0;
+    char* buffer = malloc(chunk);
+
+    if (buffer == NULL) {
+        err(1, "malloc");
+    }
+
+    fd_fifo = open(path_fifo, O_RDONLY);
+    if (fd_fifo < 0) {
+        err(1, "%s", path_fifo);
+    }
+
+    while ((rbytes = read(fd_fifo, buffer, chunk)) > 0) {
+        received += rbytes;
+    }
+
+    if (rbytes < 0) {
+        err(1, "Error when reading from the FIFO");
+    }
+
+    if (received != bytes) {
+        errx(1, "Received %ld bytes out of %ld", received, bytes);
+    }
+
+    close(fd_fifo);
+    free(buffer);
+}
+
+static pid_t spawn(void (*side)(const char *, long, int),
+                   const char* path_fifo, long bytes, int chunk) {
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        err(1, "fork");
+    } else if (pid == 0) {
+        side(path_fifo, bytes, chunk);
+        exit(EXIT_SUCCESS);
+    }
+
+    return pid;
+}
+
+static void uso(int status) {
+    if (status != EXIT_SUCCESS) {
+        warnx("Pruebe `%s -h' para obtener mas informacion.\n", nombre_programa);
+    } else {
+        printf("Uso: %s -f <path_fifo> [OPCIONES]\n", nombre_programa);
+        fputs("\
+            -b,  bytes a transferir (por defecto 4 MB)\n\
+            -c,  bytes por read() / write() (por defecto 64)\n\
+            -h,	Muestra este breve recordatorio de uso\n",
+            stdout
+        );
+    }
+    exit(status);
+}
+
+int main(int argc, char **argv) {
+    int optc;
+    int status;
+    int failed = 0;
+    char *path_fifo = NULL;
+    long bytes = DEFAULT_BYTES;
+    int chunk = DEFAULT_CHUNK;
+    long long start, elapsed;
+    long csw;
+    struct rusage usage;
+
+    nombre_programa = argv[0];
+
+    while ((optc = getopt(argc, argv, "hf:b:c:")) != -1) {
+        switch (optc) {
+            case 'h':
+                uso(EXIT_SUCCESS);
+                break;
+
+            case 'f':
+                path_fifo = optarg;
+                break;
+
+            case 'b':
+                bytes = atol(optarg);
+                break;
+
+            case 'c':
+                chunk = atoi(optarg);
+                break;
+
+            default:
+                uso(EXIT_FAILURE);
+        }
+    }
+
+    if (!path_fifo || bytes <= 0 || chunk <= 0) {
+        uso(EXIT_FAILURE);
+    }
+
+    // Whole chunks only, the producer writes `chunk` bytes at a time
+    bytes -= bytes % chunk;
+
+    start = now_ns();
+    spawn(consume, path_fifo, bytes, chunk);
+    spawn(produce, path_fifo, bytes, chunk);
+
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            failed = 1;
+        }
+    }
+    elapsed = now_ns() - start;
+
+    if (failed) {
+        errx(1, "Producer or consumer failed");
+    }
+
+    // Both children were reaped, their usage is accounted here
+    getrusage(RUSAGE_CHILDREN, &usage);
+    csw = usage.ru_nvcsw + usage.ru_nivcsw;
+
+    printf("bytes=%ld chunk=%d total_ns=%lld mb_per_sec=%.2f "
+           "voluntary_csw=%ld involuntary_csw=%ld csw_per_kb=%.3f\n",
+           bytes, chunk, elapsed, (bytes / 1048576.0) / (elapsed / 1e9),
+           usage.ru_nvcsw, usage.ru_nivcsw, csw / (bytes / 1024.0));
+
+    return 0;
+}
@@ -2,14 +2,46 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/kfifo.h>
-#include <linux/semaphore.h>
-#include <asm-generic/uaccess.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/moduleparam.h>
+#include <linux/pagemap.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/uaccess.h>
+
+#define CREATE_TRACE_POINTS
+#include "fifodev_trace.h"
 
 MODULE_LICENSE("GPL");
 
 #define DEVICE_NAME "fifodev"
-#define MAX_FIFO_SIZE 64 // 64 bytes, fits 64 chars
-#define MAX_BUFFER_SIZE 64
+
+// Bound of the nr_devices parameter
+#define MAX_DEVICES 4096
+
+// Bounds of the fifo_size parameter
+#define MIN_FIFO_SIZE 64
+#define MAX_FIFO_SIZE (16 << 20)
+
+// Transfers copy up to this many bytes between user memory and the ring
+// per fifo_lock hold. Writes up to this size (or fifo_size, if smaller)
+// are atomic, like PIPE_BUF ones on a pipe
+#define MAX_BUFFER_SIZE PAGE_SIZE
+
+static unsigned int fifo_size = 65536;
+
+module_param(fifo_size, uint, 0000);
+MODULE_PARM_DESC(fifo_size, "Capacity of the FIFO in bytes, a power of two");
+
+// Readable from /sys/module/fifodev/parameters, make_fifo.sh needs it
+static unsigned int nr_devices = 1;
+
+module_param(nr_devices, uint, 0444);
+MODULE_PARM_DESC(nr_devices, "Number of FIFOs, /dev/fifodev0 onwards");
 
 static int major;
 
@@ -18,17 +50,25 @@ static int fifodev_release(struct inode *, struct file *);
 
 static ssize_t fifodev_read(struct file *, char *, size_t, loff_t *);
 static ssize_t fifodev_write(struct file *, const char *, size_t, loff_t *);
+static unsigned int fifodev_poll(struct file *, poll_table *);
 
-// Circular buffer and associated lock
-static struct kfifo cbuffer;
-static struct semaphore mtx;
+// State of one FIFO, there's one per minor number
+typedef struct fifo_dev_t {
+    // Circular buffer, open counts and the lock protecting them all.
+    // The ring is allocated on the first open, and kept until unload
+    struct kfifo cbuffer;
+    char* cbuffer_storage;
+    spinlock_t fifo_lock;
 
-// Opened process count
-int reader_opens, writer_opens;
+    // Opened process count
+    int reader_opens, writer_opens;
 
-// Read & write queues and associated sizes
-int reader_waiting, writer_waiting;
-static struct semaphore read_queue, write_queue;
+    // Readers wait for data or a writer, writers for room or a reader
+    wait_queue_head_t readers_wq;
+    wait_queue_head_t writers_wq;
+} fifo_dev_t;
+
+static fifo_dev_t* devices;
 
 static const struct file_operations dev_fops = {
     .owner = THIS_MODULE,
@@ -36,94 +76,121 @@ static const struct file_operations dev_fops = {
     .write = fifodev_write,
     .open = fifodev_open,
     .release = fifodev_release,
+    .poll = fifodev_poll,
 };
 
+// Wait conditions, checked under fifo_lock and again locklessly by
+// wait_event_interruptible before sleeping
+
+static bool has_writers(fifo_dev_t* dev) {
+    return dev->writer_opens > 0;
+}
+
+static bool has_readers(fifo_dev_t* dev) {
+    return dev->reader_opens > 0;
+}
+
+// There's data to read, or there won't be any more
+static bool can_read(fifo_dev_t* dev) {
+    return !kfifo_is_empty(&dev->cbuffer) || dev->writer_opens == 0;
+}
+
+// There's room for `room` bytes, or no one will ever read them
+static bool can_write(fifo_dev_t* dev, size_t room) {
+    return kfifo_avail(&dev->cbuffer) >= room || dev->reader_opens == 0;
+}
+
+// Give `dev` its ring if it doesn't have one yet
+static int fifodev_alloc_ring(fifo_dev_t* dev) {
+    char* storage;
+
+    if (READ_ONCE(dev->cbuffer_storage) != NULL) {
+        return 0;
+    }
+
+    // vmalloc'ed, sizes of several MB are too large for kfifo_alloc
+    storage = vmalloc(fifo_size);
+    if (storage == NULL) {
+        return -ENOMEM;
+    }
+
+    spin_lock(&dev->fifo_lock);
+    if (dev->cbuffer_storage == NULL) {
+        kfifo_init(&dev->cbuffer, storage, fifo_size);
+        dev->cbuffer_storage = storage;
+        storage = NULL;
+    }
+    spin_unlock(&dev->fifo_lock);
+
+    // Someone else opening it won the race
+    vfree(storage);
+    return 0;
+}
+
 static int fifodev_open(struct inode *inode, struct file *filp) {
     fmode_t mode = filp->f_mode;
     unsigned int flags = filp->f_flags;
+    fifo_dev_t* dev = &devices[iminor(inode)];
 
-    // In either mode, wait until we meet with the other side
-    if (mode & FMODE_READ) {
-        int private_writers;
-        printk(KERN_INFO "fifodev: Open reader mode\n");
+    if (fifodev_alloc_ring(dev) != 0) {
+        printk(KERN_INFO "fifodev: Couldn't allocate kfifo\n");
+        return -ENOMEM;
+    }
 
-        // Fenced atomic incr and fetch
-        if (down_interruptible(&mtx)) return -EINTR;
+    filp->private_data = dev;
 
-        reader_opens++;
-        private_writers = writer_opens;
+    // In either mode, wait until we meet with the other side
+    if (mode & FMODE_READ) {
+        u64 start = ktime_get_ns();
 
-        up(&mtx);
+        spin_lock(&dev->fifo_lock);
+        dev->reader_opens++;
 
         // If file is opened in non-blocking mode and this call would block
         // return EAGAIN
-        if ((flags & O_NONBLOCK) && (private_writers == 0)) {
+        if ((flags & O_NONBLOCK) && !has_writers(dev)) {
+            dev->reader_opens--;
+            spin_unlock(&dev->fifo_lock);
             return -EAGAIN;
         }
+        spin_unlock(&dev->fifo_lock);
 
-        printk(
-            KERN_INFO "fifodev: cached writers on the other side: %i\n",
-            private_writers
-        );
-
-        up(&write_queue);
-        while (private_writers == 0) {
-            printk(KERN_INFO "fifodev: Waiting for writers to meet...\n");
-            if (down_interruptible(&read_queue)) {
-                down(&mtx);
-                reader_opens--;
-                up(&mtx);
-                return -EINTR;
-            }
-
-            // Refresh
-            if (down_interruptible(&mtx)) return -EINTR;
-            private_writers = writer_opens;
-            up(&mtx);
+        wake_up_interruptible(&dev->writers_wq);
+        if (wait_event_interruptible(dev->readers_wq, has_writers(dev))) {
+            spin_lock(&dev->fifo_lock);
+            dev->reader_opens--;
+            spin_unlock(&dev->fifo_lock);
+            return -EINTR;
         }
 
-        printk(KERN_INFO "fifodev: Reader matched with writer\n");
+        trace_fifodev_open(iminor(inode), true, dev->writer_opens,
+                           ktime_get_ns() - start);
 
     } else {
-        int private_readers;
-        printk(KERN_INFO "fifodev: Open writer mode\n");
+        u64 start = ktime_get_ns();
 
-        // Fenced atomic incr and fetch
-        if (down_interruptible(&mtx)) return -EINTR;
-
-        writer_opens++;
-        private_readers = reader_opens;
-
-        up(&mtx);
+        spin_lock(&dev->fifo_lock);
+        dev->writer_opens++;
 
         // If file is opened in non-blocking mode and this call would block
         // return EAGAIN
-        if ((flags & O_NONBLOCK) && (private_readers == 0)) {
+        if ((flags & O_NONBLOCK) && !has_readers(dev)) {
+            dev->writer_opens--;
+            spin_unlock(&dev->fifo_lock);
             return -EAGAIN;
         }
+        spin_unlock(&dev->fifo_lock);
 
-        printk(
-            KERN_INFO "fifodev: cached readers on the other side: %i\n",
-            private_readers
-        );
-
-        up(&read_queue);
-        while (private_readers == 0) {
-            printk(KERN_INFO "fifodev: Waiting for readers to meet...\n");
-            if (down_interruptible(&write_queue)) {
-                down(&mtx);
-                writer_opens--;
-                up(&mtx);
-                return -EINTR;
-            }
-
-            // Refresh
-            if (down_interruptible(&mtx)) return -EINTR;
-            private_readers = reader_opens;
-            up(&mtx);
+        wake_up_interruptible(&dev->readers_wq);
+        if (wait_event_interruptible(dev->writers_wq, has_readers(dev))) {
+            spin_lock(&dev->fifo_lock);
+            dev->writer_opens--;
+            spin_unlock(&dev->fifo_lock);
+            return -EINTR;
         }
 
-        printk(KERN_INFO "fifodev: Writer matched with reader\n");
+        trace_fifodev_open(iminor(inode), false, dev->reader_opens,
+                           ktime_get_ns() - start);
     }
 
     return 0;
@@ -131,195 +198,294 @@ static int fifodev_open(struct inode *inode, struct file *filp) {
 
 static int fifodev_release(struct inode *inode, struct file *filp) {
     fmode_t mode = filp->f_mode;
-    if (mode & FMODE_READ) {
-        printk(KERN_INFO "fifodev: Close reader mode\n");
-        if (down_interruptible(&mtx)) return -EINTR;
-        reader_opens--;
-
-        // Signal writers that we're leaving
-        up(&write_queue);
+    fifo_dev_t* dev = filp->private_data;
 
-        // If we're the last one, flush fifo
-        if (reader_opens == 0 && writer_opens == 0) {
-            kfifo_reset(&cbuffer);
-        }
-        up(&mtx);
+    spin_lock(&dev->fifo_lock);
+    if (mode & FMODE_READ) {
+        dev->reader_opens--;
     } else {
-        printk(KERN_INFO "fifodev: Close writer mode\n");
-        if (down_interruptible(&mtx)) return -EINTR;
-        writer_opens--;
+        dev->writer_opens--;
+    }
 
-        // Signal writers that we're leaving
-        up(&read_queue);
+    // If we're the last one, flush fifo
+    if (dev->reader_opens == 0 && dev->writer_opens == 0) {
+        kfifo_reset(&dev->cbuffer);
+    }
+    trace_fifodev_release(iminor(inode), mode & FMODE_READ, dev->reader_opens,
+                          dev->writer_opens);
+    spin_unlock(&dev->fifo_lock);
 
-        // If we're the last one, flush fifo
-        if (reader_opens == 0 && writer_opens == 0) {
-            kfifo_reset(&cbuffer);
-        }
-        up(&mtx);
+    // Signal the other side that we're leaving
+    if (mode & FMODE_READ) {
+        wake_up_interruptible(&dev->writers_wq);
+    } else {
+        wake_up_interruptible(&dev->readers_wq);
     }
 
     return 0;
 }
 
+// Like a pipe, wait for some data and return as much of it as fits in
+// `len`, 0 once it's empty and every writer is gone. In non-blocking mode
+// -EAGAIN instead of waiting.
+//
+// Data goes straight from the ring to `buf`. The copy runs under
+// fifo_lock with page faults disabled, a page that isn't there is faulted
+// in with the lock dropped and the copy retried
 static ssize_t fifodev_read(struct file *filp, char __user *buf, size_t len, loff_t *off) {
-    int bytes_extracted;
-    char own_buffer[MAX_BUFFER_SIZE];
-
-    printk(KERN_INFO "fifodev: Reading file\n");
-
-    // If trying to read with size larger than kfifo max size, return error
-    if (len > MAX_FIFO_SIZE || len > MAX_BUFFER_SIZE) {
-        return -ENOSPC;
+    fifo_dev_t* dev = filp->private_data;
+    int ret = 0;
+    size_t done = 0;
+    unsigned int copied;
+    unsigned int used;
+    u64 start = ktime_get_ns();
+
+    if (len == 0) {
+        return 0;
     }
 
-    if (down_interruptible(&mtx)) return -EINTR;
+    spin_lock(&dev->fifo_lock);
+    while (!can_read(dev)) {
+        spin_unlock(&dev->fifo_lock);
 
-    // If trying to read with size less than kfifo size,
-    // block caller with read_queue
-    //
-    // we can do the comparison directly since we store chars
-    while (kfifo_len(&cbuffer) < len && writer_opens > 0) {
-        reader_waiting++;
-        up(&mtx);
-
-        printk(
-            KERN_INFO "fifodev: Buffer not full enough, will wait until there's enough\n"
-        );
+        if (filp->f_flags & O_NONBLOCK) {
+            return -EAGAIN;
+        }
 
-        if (down_interruptible(&read_queue)) {
-            down(&mtx);
-            reader_waiting--;
-            up(&mtx);
+        if (wait_event_interruptible(dev->readers_wq, can_read(dev))) {
             return -EINTR;
         }
 
-        printk(KERN_INFO "fifodev: Reader awoke, will check buffer again\n");
-
-        if (down_interruptible(&mtx)) return -EINTR;
+        spin_lock(&dev->fifo_lock);
     }
 
-    // If trying to read from empty kfifo, and no writers are present,
-    // return 0 (EOF)
-    if (kfifo_is_empty(&cbuffer) && writer_opens == 0) {
-        up(&mtx);
-        return 0;
-    }
+    // Drain what's there without waiting for more
+    while (done < len && !kfifo_is_empty(&dev->cbuffer)) {
+        pagefault_disable();
+        ret = kfifo_to_user(&dev->cbuffer, buf + done,
+                            min_t(size_t, len - done, MAX_BUFFER_SIZE), &copied);
+        pagefault_enable();
+        spin_unlock(&dev->fifo_lock);
+
+        done += copied;
+        if (copied > 0) {
+            wake_up_interruptible(&dev->writers_wq);
+        }
 
-    bytes_extracted = kfifo_out(&cbuffer, &own_buffer, len);
+        if (ret != 0) {
+            if (fault_in_pages_writeable(buf + done,
+                                         min_t(size_t, len - done, PAGE_SIZE))) {
+                spin_lock(&dev->fifo_lock);
+                break;
+            }
+            ret = 0;
+        }
 
-    if (writer_waiting > 0) {
-        up(&write_queue);
-        writer_waiting--;
+        spin_lock(&dev->fifo_lock);
     }
 
-    up(&mtx);
+    used = kfifo_len(&dev->cbuffer);
+    spin_unlock(&dev->fifo_lock);
 
-    if (copy_to_user(buf, own_buffer, len)) {
-        return -EFAULT;
+    trace_fifodev_read(iminor(file_inode(filp)), done, used, ktime_get_ns() - start);
+
+    if (done == 0) {
+        return ret;
     }
 
-    *off += len;
-    return len;
+    *off += done;
+    return done;
 }
 
+// Like a pipe, block until all `len` bytes are in, streaming them into
+// the ring as readers make room. Short writes only happen on errors, or
+// in non-blocking mode once the ring fills up, -EAGAIN if nothing fit.
+//
+// Data goes straight from `buf` to the ring, faults are handled as in
+// fifodev_read. Atomic writes are staged in a kernel buffer instead, so
+// a fault can't leave half of them in the ring
 static ssize_t fifodev_write(struct file *filp, const char __user *buf, size_t len, loff_t *off) {
-    int bytes_written;
-    char own_buffer[MAX_BUFFER_SIZE + 1];
+    fifo_dev_t* dev = filp->private_data;
+    int ret = 0;
+    size_t done = 0;
+    unsigned int copied;
+    unsigned int used = 0;
+    char* own_buffer = NULL;
+    u64 start = ktime_get_ns();
+
+    // Room to wait for, all of it for atomic writes
+    size_t room = (len <= min_t(size_t, MAX_BUFFER_SIZE, fifo_size)) ? len : 1;
+
+    if (len == 0) {
+        return 0;
+    }
 
-    printk(KERN_INFO "fifodev: Writing file\n");
+    if (room == len) {
+        own_buffer = kmalloc(len, GFP_KERNEL);
+        if (own_buffer == NULL) {
+            return -ENOMEM;
+        }
 
-    // If trying to write with size larger than kfifo max size, return error
-    if (len > MAX_FIFO_SIZE || len > MAX_BUFFER_SIZE) {
-        return -ENOSPC;
+        if (copy_from_user(own_buffer, buf, len)) {
+            kfree(own_buffer);
+            return -EFAULT;
+        }
     }
 
-    if (copy_from_user(own_buffer, buf, len)) {
-        return -EFAULT;
-    }
+    while (done < len) {
+        spin_lock(&dev->fifo_lock);
+        while (!can_write(dev, room)) {
+            spin_unlock(&dev->fifo_lock);
 
-    own_buffer[len] = '\0';
-    *off += len;
+            if (filp->f_flags & O_NONBLOCK) {
+                ret = -EAGAIN;
+                break;
+            }
 
-    if (down_interruptible(&mtx)) return -EINTR;
+            if (wait_event_interruptible(dev->writers_wq, can_write(dev, room))) {
+                ret = -EINTR;
+                break;
+            }
+
+            spin_lock(&dev->fifo_lock);
+        }
 
-    // If there's no room in kfifo to write the entire buffer,
-    // block the caller with write_queue
-    while (kfifo_avail(&cbuffer) < len && reader_opens > 0) {
-        writer_waiting++;
-        up(&mtx);
+        if (ret != 0) {
+            break;
+        }
 
-        printk(KERN_INFO "fifodev: Reader present, waiting for signal\n");
+        // Reader exited while we waited
+        if (dev->reader_opens == 0) {
+            spin_unlock(&dev->fifo_lock);
+            ret = -EPIPE;
+            break;
+        }
 
-        if (down_interruptible(&write_queue)) {
-            down(&mtx);
-            writer_waiting--;
-            up(&mtx);
-            return -EINTR;
+        if (own_buffer != NULL) {
+            copied = kfifo_in(&dev->cbuffer, own_buffer, len);
+        } else {
+            pagefault_disable();
+            ret = kfifo_from_user(&dev->cbuffer, buf + done,
+                                  min_t(size_t, len - done, MAX_BUFFER_SIZE),
+                                  &copied);
+            pagefault_enable();
         }
 
-        printk(KERN_INFO "fifodev: Writer awoke, will check buffer again\n");
+        used = kfifo_len(&dev->cbuffer);
+        spin_unlock(&dev->fifo_lock);
 
-        if (down_interruptible(&mtx)) return -EINTR;
+        done += copied;
+        if (copied > 0) {
+            wake_up_interruptible(&dev->readers_wq);
+        }
+
+        if (ret != 0) {
+            if (fault_in_pages_readable(buf + done,
+                                        min_t(size_t, len - done, PAGE_SIZE))) {
+                break;
+            }
+            ret = 0;
+        }
     }
 
-    // If writing to FIFO without readers, return error
-    if (reader_opens == 0) {
-        up(&mtx);
-        printk(KERN_INFO "fifodev: Reader exited while we waited\n");
-        // TODO: What kind of error do we return here?
-        return -1;
+    trace_fifodev_write(iminor(file_inode(filp)), done, used, ktime_get_ns() - start);
+    kfree(own_buffer);
+
+    if (done == 0) {
+        return ret;
     }
 
-    bytes_written = kfifo_in(&cbuffer, own_buffer, len);
+    *off += done;
+    return done;
+}
+
+// Readable with data in the ring, writable with room for an atomic write,
+// as with pipes. A side whose peers are all gone gets POLLHUP / POLLERR
+static unsigned int fifodev_poll(struct file *filp, poll_table *wait) {
+    fifo_dev_t* dev = filp->private_data;
+    unsigned int mask = 0;
 
-    if (reader_waiting > 0) {
-        up(&read_queue);
-        reader_waiting--;
+    // Each side is only woken up by the events it cares about
+    if (filp->f_mode & FMODE_READ) {
+        poll_wait(filp, &dev->readers_wq, wait);
+    }
+    if (filp->f_mode & FMODE_WRITE) {
+        poll_wait(filp, &dev->writers_wq, wait);
     }
 
-    up(&mtx);
+    spin_lock(&dev->fifo_lock);
+    if (filp->f_mode & FMODE_READ) {
+        if (!kfifo_is_empty(&dev->cbuffer)) {
+            mask |= POLLIN | POLLRDNORM;
+        }
+        if (dev->writer_opens == 0) {
+            mask |= POLLHUP;
+        }
+    }
 
-    if (bytes_written < len) {
-        // TODO: What to do here?
-        printk(KERN_INFO "fifodev: Couldn't write everything\n");
-        return -ENOSPC;
+    if (filp->f_mode & FMODE_WRITE) {
+        if (kfifo_avail(&dev->cbuffer) >= min_t(size_t, MAX_BUFFER_SIZE, fifo_size)) {
+            mask |= POLLOUT | POLLWRNORM;
+        }
+        if (dev->reader_opens == 0) {
+            mask |= POLLERR;
+        }
     }
+    spin_unlock(&dev->fifo_lock);
 
-    return len;
+    return mask;
 }
 
 int fifoproc_module_init(void) {
-    if (kfifo_alloc(&cbuffer, MAX_FIFO_SIZE, GFP_KERNEL) != 0) {
-        printk(KERN_INFO "fifodev: Couldn't allocate kfifo\n");
-        return -ENOMEM;
-    }
+    int i;
 
-    sema_init(&mtx, 1);
+    if (!is_power_of_2(fifo_size) || fifo_size < MIN_FIFO_SIZE ||
+        fifo_size > MAX_FIFO_SIZE) {
+        printk(KERN_INFO "fifodev: fifo_size must be a power of two between %d and %d\n",
+               MIN_FIFO_SIZE, MAX_FIFO_SIZE);
+        return -EINVAL;
+    }
 
-    sema_init(&read_queue, 0);
-    sema_init(&write_queue, 0);
+    if (nr_devices == 0 || nr_devices > MAX_DEVICES) {
+        printk(KERN_INFO "fifodev: nr_devices must be between 1 and %d\n",
+               MAX_DEVICES);
+        return -EINVAL;
+    }
 
-    reader_opens = 0;
-    writer_opens = 0;
+    devices = kcalloc(nr_devices, sizeof(fifo_dev_t), GFP_KERNEL);
+    if (devices == NULL) {
+        printk(KERN_INFO "fifodev: Couldn't allocate devices\n");
+        return -ENOMEM;
+    }
 
-    reader_waiting = 0;
-    writer_waiting = 0;
+    for (i = 0; i < nr_devices; i++) {
+        spin_lock_init(&devices[i].fifo_lock);
+        init_waitqueue_head(&devices[i].readers_wq);
+        init_waitqueue_head(&devices[i].writers_wq);
+    }
 
-    major = register_chrdev(0, DEVICE_NAME, &dev_fops);
+    major = __register_chrdev(0, 0, nr_devices, DEVICE_NAME, &dev_fops);
     if (major < 0) {
-        kfifo_free(&cbuffer);
+        kfree(devices);
         printk(KERN_ALERT "fifodev: Can't register device: %d\n", major);
         return major;
     }
 
-    printk(KERN_INFO "fifodev: module loaded with major %d, minor: 0\n", major);
+    printk(KERN_INFO "fifodev: module loaded with major %d, minors: 0-%u, a %u bytes fifo each\n",
+           major, nr_devices - 1, fifo_size);
     return 0;
 }
 
 void fifoproc_module_cleanup(void) {
-    kfifo_free(&cbuffer);
-    unregister_chrdev(major, DEVICE_NAME);
+    int i;
+
+    __unregister_chrdev(major, 0, nr_devices, DEVICE_NAME);
+
+    for (i = 0; i < nr_devices; i++) {
+        vfree(devices[i].cbuffer_storage);
+    }
+    kfree(devices);
+
     printk(KERN_INFO "fifodev: module unloaded\n");
 }
 
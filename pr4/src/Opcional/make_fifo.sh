@@ -4,12 +4,14 @@ module="fifodev"
 device="fifodev"
 mode="666"
 
-if [[ -c /dev/${device} ]]; then
-    rm -rf /dev/${device}
-fi
+# One device per minor, /dev/fifodev0 to /dev/fifodev<nr_devices - 1>
+nr_devices=$(cat /sys/module/${module}/parameters/nr_devices)
 
-major=$(awk -v module=${module} '$2 == module {print $1}' /proc/devices)
+rm -f /dev/${device}[0-9]*
 
-mknod /dev/${device} c ${major} 0
+major=$(awk -v module=${module} '$2 == module {print $1}' /proc/devices)
 
-chmod $mode /dev/${device}
+for minor in $(seq 0 $((nr_devices - 1))); do
+    mknod /dev/${device}${minor} c ${major} ${minor}
+    chmod $mode /dev/${device}${minor}
+done
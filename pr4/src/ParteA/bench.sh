@@ -0,0 +1,66 @@
+#!/usr/bin/env bash
+
+# Times `remove` on lists of increasing size. Run it once with the module
+# built from the previous revision loaded and once with the current one to
+# compare the linear list walk against the hashed lookup.
+#
+# Works with both pr1/src and pr4/src/ParteA, they share /proc/modlist
+
+export mod_file="/proc/modlist"
+
+# List sizes to measure
+sizes="${SIZES:-10000 100000 1000000}"
+
+# Number of removes timed per list size
+removes="${REMOVES:-1000}"
+
+now_ns() {
+    date +%s%N
+}
+
+# Fill the list with 1..size, reusing a single descriptor
+fill_list() {
+    local size="$1"
+    echo "cleanup" > "${mod_file}"
+    exec 3> "${mod_file}"
+    for i in $(seq 1 "${size}"); do
+        echo "add ${i}" >&3
+    done
+    exec 3>&-
+}
+
+# Remove `removes` random elements and report the time it took
+bench_remove() {
+    local size="$1"
+    local start
+    local end
+    local values
+
+    values=$(shuf -i 1-"${size}" -n "${removes}")
+
+    exec 3> "${mod_file}"
+    start=$(now_ns)
+    for i in ${values}; do
+        echo "remove ${i}" >&3
+    done
+    end=$(now_ns)
+    exec 3>&-
+
+    echo "size=${size} removes=${removes} total_ns=$((end - start)) ns_per_op=$(((end - start) / removes))"
+}
+
+main() {
+    if [[ ! -a "${mod_file}" ]]; then
+        echo "Module not loaded, aborting..."
+        exit -1
+    fi
+
+    for size in ${sizes}; do
+        fill_list "${size}"
+        bench_remove "${size}"
+    done
+
+    echo "cleanup" > "${mod_file}"
+}
+
+main "$@"
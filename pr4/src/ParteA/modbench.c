@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+
+// Times `add` on /proc/modlist with 1 to N concurrent writers, each one a
+// thread pinned to its own CPU with its own descriptor. The write buffers
+// are formatted before the clock starts, so every writer only runs
+// write() in a tight loop and the timings are the module's:
+//
+//   insmod modlist.ko && ./modbench
+//   insmod modlist.ko sharded=1 && ./modbench -w 8 -b 1
+//
+// Load the module with sharded=0 and sharded=1 to compare the global
+// lock against per-CPU shards, and with append=0 and append=1 to check
+// the latency of a write stays flat as writers grow. Every write() is
+// timed, percentiles are over the writes of all the writers, so with
+// -b 1 they are the latency of a single add
+
+#define MOD_FILE "/proc/modlist"
+#define DEFAULT_ADDS 100000
+#define DEFAULT_BATCH 64
+
+char *nombre_programa = NULL;
+
+struct writer {
+    pthread_t thread;
+    int id;
+    int cpu;
+    int fd;
+    // Every write() of the writer, one after the other
+    char* buffer;
+    size_t* lens;
+    long nr_writes;
+    // Latency of every write()
+    long long* latencies;
+    long long start_ns;
+    long long end_ns;
+};
+
+static pthread_barrier_t start_barrier;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void write_command(const char* command) {
+    int fd = open(MOD_FILE, O_WRONLY);
+
+    if (fd < 0) {
+        err(1, "%s", MOD_FILE);
+    }
+
+    if (write(fd, command, strlen(command)) != (ssize_t) strlen(command)) {
+        err(1, "Error when writing `%s'", command);
+    }
+
+    close(fd);
+}
+
+// Format the `adds` values of writer `id`, `batch` of them per write.
+// Writers add disjoint values so none of them hits a duplicate
+static void writer_prepare(struct writer* w, long adds, int batch) {
+    long i;
+    size_t off = 0;
+    // "add" plus a space and up to 10 digits per value, and the newline
+    size_t cap = 4 + adds * 11 + (adds / batch + 1);
+
+    w->nr_writes = (adds + batch - 1) / batch;
+    w->buffer = malloc(cap);
+    w->lens = malloc(w->nr_writes * sizeof(size_t));
+    w->latencies = malloc(w->nr_writes * sizeof(long long));
+    if (w->buffer == NULL || w->lens == NULL || w->latencies == NULL) {
+        err(1, "malloc");
+    }
+
+    for (i = 0; i < adds; i++) {
+        if (i % batch == 0) {
+            off += sprintf(w->buffer + off, "add");
+        }
+
+        off += sprintf(w->buffer + off, " %ld", w->id * adds + i);
+
+        if (i % batch == batch - 1 || i == adds - 1) {
+            w->buffer[off++] = '\n';
+            w->lens[i / batch] = off;
+        }
+    }
+
+    w->fd = open(MOD_FILE, O_WRONLY);
+    if (w->fd < 0) {
+        err(1, "%s", MOD_FILE);
+    }
+}
+
+static void writer_free(struct writer* w) {
+    close(w->fd);
+    free(w->buffer);
+    free(w->lens);
+    free(w->latencies);
+}
+
+static void* writer_run(void* arg) {
+    struct writer* w = arg;
+    cpu_set_t cpus;
+    size_t off = 0;
+    size_t len;
+    long long start;
+    long i;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(w->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        warnx("Couldn't pin writer %d to CPU %d", w->id, w->cpu);
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    w->start_ns = now_ns();
+
+    for (i = 0; i < w->nr_writes; i++) {
+        len = w->lens[i] - off;
+        start = now_ns();
+        if (write(w->fd, w->buffer + off, len) != (ssize_t) len) {
+            err(1, "Error when writing to " MOD_FILE);
+        }
+        w->latencies[i] = now_ns() - start;
+        off = w->lens[i];
+    }
+
+    w->end_ns = now_ns();
+    return NULL;
+}
+
+static int compare_ll(const void* a, const void* b) {
+    long long x = *(const long long*) a;
+    long long y = *(const long long*) b;
+    return (x > y) - (x < y);
+}
+
+// Value below which `per_mille` thousandths of the sorted `n` fall
+static long long percentile(const long long* sorted, long n, int per_mille) {
+    return sorted[(n - 1) * per_mille / 1000];
+}
+
+static void bench_writers(int nr_writers, long adds, int batch) {
+    struct writer* writers = calloc(nr_writers, sizeof(struct writer));
+    long long start = 0, end = 0, elapsed;
+    long total = nr_writers * adds;
+    long long* all;
+    long nr_all = 0;
+    long j;
+    int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if (writers == NULL) {
+        err(1, "malloc");
+    }
+
+    write_command("cleanup\n");
+
+    for (i = 0; i < nr_writers; i++) {
+        writers[i].id = i;
+        writers[i].cpu = i % ncpus;
+        writer_prepare(&writers[i], adds, batch);
+    }
+
+    // Every writer times itself, the main thread may be scheduled out
+    // while they run. The clock runs from the first start to the last end
+    pthread_barrier_init(&start_barrier, NULL, nr_writers + 1);
+    for (i = 0; i < nr_writers; i++) {
+        if (pthread_create(&writers[i].thread, NULL, writer_run, &writers[i]) != 0) {
+            errx(1, "Couldn't create writer %d", i);
+        }
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    for (i = 0; i < nr_writers; i++) {
+        pthread_join(writers[i].thread, NULL);
+        if (i == 0 || writers[i].start_ns < start) {
+            start = writers[i].start_ns;
+        }
+        if (writers[i].end_ns > end) {
+            end = writers[i].end_ns;
+        }
+    }
+    elapsed = end - start;
+    pthread_barrier_destroy(&start_barrier);
+
+    all = malloc(nr_writers * writers[0].nr_writes * sizeof(long long));
+    if (all == NULL) {
+        err(1, "malloc");
+    }
+
+    for (i = 0; i < nr_writers; i++) {
+        for (j = 0; j < writers[i].nr_writes; j++) {
+            all[nr_all++] = writers[i].latencies[j];
+        }
+    }
+    qsort(all, nr_all, sizeof(long long), compare_ll);
+
+    printf("writers=%d adds=%ld batch=%d total_ns=%lld ns_per_add=%.1f "
+           "write_p50_ns=%lld write_p90_ns=%lld write_p99_ns=%lld "
+           "write_p999_ns=%lld write_max_ns=%lld\n",
+           nr_writers, total, batch, elapsed, (double) elapsed / total,
+           percentile(all, nr_all, 500), percentile(all, nr_all, 900),
+           percentile(all, nr_all, 990), percentile(all, nr_all, 999),
+           all[nr_all - 1]);
+    fflush(stdout);
+    free(all);
+
+    for (i = 0; i < nr_writers; i++) {
+        writer_free(&writers[i]);
+    }
+    free(writers);
+}
+
+static void uso(int status) {
+    if (status != EXIT_SUCCESS) {
+        warnx("Pruebe `%s -h' para obtener mas informacion.\n", nombre_programa);
+    } else {
+        printf("Uso: %s [OPCIONES]\n", nombre_programa);
+        fputs("\
+            -w,  numero maximo de escritores (por defecto uno por CPU)\n\
+            -a,  adds por escritor (por defecto 100000)\n\
+            -b,  valores por write() (por defecto 64)\n\
+            -h,	Muestra este breve recordatorio de uso\n",
+            stdout
+        );
+    }
+    exit(status);
+}
+
+int main(int argc, char **argv) {
+    int optc;
+    int nr_writers;
+    int max_writers = sysconf(_SC_NPROCESSORS_ONLN);
+    long adds = DEFAULT_ADDS;
+    int batch = DEFAULT_BATCH;
+
+    nombre_programa = argv[0];
+
+    while ((optc = getopt(argc, argv, "hw:a:b:")) != -1) {
+        switch (optc) {
+            case 'h':
+                uso(EXIT_SUCCESS);
+                break;
+
+            case 'w':
+                max_writers = atoi(optarg);
+                break;
+
+            case 'a':
+                adds = atol(optarg);
+                break;
+
+            case 'b':
+                batch = atoi(optarg);
+                break;
+
+            default:
+                uso(EXIT_FAILURE);
+        }
+    }
+
+    // Values must fit in an int, and a write in a module chunk
+    if (max_writers <= 0 || adds <= 0 || batch <= 0 || batch > 256 ||
+        max_writers * adds > 2147483647L) {
+        uso(EXIT_FAILURE);
+    }
+
+    for (nr_writers = 1; nr_writers <= max_writers; nr_writers++) {
+        bench_writers(nr_writers, adds, batch);
+    }
+
+    write_command("cleanup\n");
+
+    return 0;
+}
@@ -1,121 +1,533 @@
 #include <asm-generic/uaccess.h>
+#include <linux/hashtable.h>
 #include <linux/kernel.h>
+#include <linux/limits.h>
+#include <linux/llist.h>
+#include <linux/log2.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/spinlock.h>
 #include <linux/proc_fs.h>
+#include <linux/rculist.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 
-#define READ_BUF_LEN 256
+// Writes are consumed in chunks of this size
+#define WRITE_CHUNK_LEN PAGE_SIZE
+
+// Longest token we may carry from one chunk to the next, enough for any
+// keyword or for "-2147483648"
+#define MAX_TOKEN_LEN 16
+
+// 2^16 buckets keep the chains short even with a million elements. In
+// sharded mode they are split among the shards, down to 2^10 per shard
+#define ITEM_HASH_BITS 16
+#define SHARD_HASH_MIN_BITS 10
 
 MODULE_LICENSE("GPL");
 
-struct list_head* llist;
+// With `sharded` set every CPU gets its own sublist and lock
+static bool sharded;
+module_param(sharded, bool, 0000);
+MODULE_PARM_DESC(sharded, "Give every CPU its own sublist and lock");
+
+// With `append` set adds don't take the lock, they are pushed on a
+// lock-free staging list that readers and removers merge first
+static bool append;
+module_param(append, bool, 0000);
+MODULE_PARM_DESC(append, "Stage adds on a lock-free list");
+
 typedef struct list_item_t {
   int data;
   struct list_head links;
+  struct hlist_node hlinks;
+  // A node is staged before it is linked and freed after it is unlinked,
+  // never both at once
+  union {
+    struct llist_node stage;
+    struct rcu_head rcu;
+  };
 } list_item_t;
 
-DEFINE_SPINLOCK(sp);
+// A sublist with its own lock and index of its items keyed by value.
+// Items are linked in insertion order through `links`, `hlinks` only
+// speeds up lookups. The lock only serializes writers, readers traverse
+// the list under RCU
+//
+// Without `sharded` there is a single shard. With it there is one per
+// possible CPU, and the adds of a write go to the shard of the CPU that
+// applies them. Reads walk the shards one after the other, `remove`,
+// `contains` and `cleanup` visit all of them.
+//
+// Ordering: values in a shard are read in the order they were added, so
+// values added from the same CPU are read back FIFO. This covers a writer
+// pinned to a CPU, and the adds of a single write of up to WRITE_CHUNK_LEN
+// bytes, which always land in one shard. Nothing is guaranteed between
+// values added from different CPUs
+//
+// In append mode adds are pushed on `staged` without the lock. Readers,
+// removers and lookups move the staged nodes to the list, in the order
+// they were pushed, before they look at it
+typedef struct list_shard_t {
+  spinlock_t lock;
+  struct list_head list;
+  struct hlist_head* table;
+  struct llist_head staged;
+} ____cacheline_aligned_in_smp list_shard_t;
+
+static list_shard_t* shards;
+static unsigned int nr_shards;
+static unsigned int shard_hash_bits;
+
+// Dedicated slab for the list nodes, shows up as `modlist_item`
+// in /proc/slabinfo
+static struct kmem_cache* item_cache;
+
+// Position of the last node handed out by the seq_file iterator, so that
+// consecutive read() calls resume where the previous one stopped instead
+// of walking the list from the head again
+typedef struct list_cursor_t {
+  struct list_head* node;
+  unsigned int shard;
+  loff_t pos;
+  long gen;
+} list_cursor_t;
+
+// Bumped every time a node is unlinked, invalidating all cached cursors.
+// Atomic as removers on different shards don't share a lock
+static atomic_long_t list_gen = ATOMIC_LONG_INIT(0);
+
+// Commands accepted by modlist_write. A write holds any number of
+// newline-separated commands, `add`, `remove` and `contains` take one or
+// more values each:
+//
+//   add 1 2 3
+//   remove 2
+//   contains 1 3
+//   cleanup
+//
+// `contains` doesn't fail the write, the next read() on the same file
+// returns 1 if every value it checked was in the list and 0 otherwise
+typedef enum list_cmd_t {
+  CMD_NONE = 0,
+  CMD_ADD,
+  CMD_REMOVE,
+  CMD_CONTAINS,
+  CMD_CLEANUP
+} list_cmd_t;
+
+// Answer to the contains of the last write that had any, read() returns
+// it instead of the list once set. A write with several of them answers
+// with the highest value seen, MISSING if any value was
+typedef enum list_answer_t {
+  ANSWER_NONE = 0,
+  ANSWER_FOUND,
+  ANSWER_MISSING
+} list_answer_t;
+
+// The events use list_cmd_t, so they come after it
+#define CREATE_TRACE_POINTS
+#include "modlist_trace.h"
+
+// Tokenizer state, `cmd` is CMD_NONE at the start of a line. A command
+// may be split across several writes, `token` holds the bytes of a token
+// cut at the end of the previous chunk
+typedef struct list_parser_t {
+  list_cmd_t cmd;
+  int nr_values;
+  size_t token_len;
+  char token[MAX_TOKEN_LEN];
+} list_parser_t;
+
+// Called by parse_batch for every (command, value) pair found
+typedef int (*list_op_fn)(list_cmd_t cmd, int data, void* ctx);
+
+// State of a batch being applied, nodes for every `add` are allocated
+// up front so runs of adds go in under a single lock acquisition
+typedef struct list_batch_t {
+  struct list_head spare;
+  int nr_adds;
+  list_answer_t answer;
+  // Shard receiving the adds, its lock is held while `locked` is set
+  list_shard_t* home;
+  bool locked;
+} list_batch_t;
+
+// Per open file state, reachable through the seq_file in private_data
+typedef struct list_private_t {
+  list_cursor_t cursor;
+  list_parser_t parser;
+  list_answer_t answer;
+  // Staging buffer for writes, allocated on the first one
+  char* chunk;
+  struct mutex lock;
+} list_private_t;
 
 static struct proc_dir_entry* proc_entry;
 
-struct list_head* list_head_init(void);
+int shards_init(void);
+void shards_free(void);
 struct list_item_t* list_item_init(struct list_item_t data);
 
-void add_item(struct list_head* list, int data);
+int list_items_alloc(struct list_head* spare, int count);
+void list_items_free(struct list_head* spare);
+
+void __add_item(list_shard_t* shard, list_item_t* item);
+void __drain_shard(list_shard_t* shard);
+void drain_shards(void);
 bool match_item(list_item_t* item, int data);
-void remove_item(struct list_head* list, int data);
+void __remove_item(list_shard_t* shard, int data);
+void remove_item(int data);
+bool contains_item(int data);
 void free_item(list_item_t* item);
-void cleanup(struct list_head* list);
+void free_item_rcu(struct rcu_head* head);
+void __cleanup(list_shard_t* shard);
+void cleanup(void);
+
+int parse_int(const char* token, size_t len, int* container);
+list_cmd_t parse_keyword(const char* token, size_t len);
+int parse_batch(list_parser_t* parser, const char* buffer, size_t len,
+                list_op_fn fn, void* ctx);
+int parse_eol(list_parser_t* parser);
+int parse_end(list_parser_t* parser, list_op_fn fn, void* ctx);
+
+// RCU flavour of seq_list_start across the shards, returns the node at
+// `pos` or NULL and stores the shard it belongs to in `shard`
+static struct list_head* list_seek_rcu(loff_t pos, unsigned int* shard) {
+  unsigned int i;
+  struct list_head* cur_node = NULL;
 
-int print_list(struct list_head* list, char* buf);
+  for (i = 0; i < nr_shards; i++) {
+    __list_for_each_rcu(cur_node, &shards[i].list) {
+      if (pos-- == 0) {
+        *shard = i;
+        return cur_node;
+      }
+    }
+  }
 
-int scancleanup(const char* buffer);
-int scanadd(const char* buffer, void* container);
-int scanremove(const char* buffer, void* container);
+  return NULL;
+}
 
-static ssize_t modlist_read(struct file* fd, char __user* buf, size_t len,
-                            loff_t* off) {
-  int size;
-  int to_copy;
-  char own_buffer[READ_BUF_LEN];
+static void* modlist_seq_start(struct seq_file* m, loff_t* pos)
+    __acquires(RCU) {
+  long gen;
+  list_private_t* priv = m->private;
+  list_cursor_t* cursor = &priv->cursor;
 
-  printk(KERN_ALERT "Modlist: Calling read\n");
+  trace_modlist_read(*pos);
 
-  if (len == 0) {
-    return 0;
+  // The answer to a contains is a single line, the lock is still taken
+  // as modlist_seq_stop drops it
+  if (priv->answer != ANSWER_NONE) {
+    rcu_read_lock();
+    return ((*pos) == 0) ? SEQ_START_TOKEN : NULL;
   }
 
-  if ((*off) > 0) {
-    return 0;
+  // Staged nodes go to the tail, cached cursors stay valid
+  drain_shards();
+
+  rcu_read_lock();
+
+  // Resume from the cached node if nothing was removed since we stored it.
+  // Removers bump list_gen before handing the node to call_rcu, so seeing
+  // the old value here means the node can't be freed until we unlock
+  gen = atomic_long_read(&list_gen);
+  if (cursor->node != NULL && cursor->pos == (*pos) && cursor->gen == gen) {
+    return cursor->node;
   }
 
-  size = print_list(llist, own_buffer);
-  if (size <= 0) {
-    printk(KERN_INFO "Modlist: Empty list\n");
+  cursor->node = list_seek_rcu(*pos, &cursor->shard);
+  cursor->pos = *pos;
+  cursor->gen = gen;
+  return cursor->node;
+}
+
+static void* modlist_seq_next(struct seq_file* m, void* v, loff_t* pos) {
+  struct list_head* next;
+  list_private_t* priv = m->private;
+  list_cursor_t* cursor = &priv->cursor;
+  unsigned int i = cursor->shard;
+
+  if (v == SEQ_START_TOKEN) {
+    ++(*pos);
+    return NULL;
+  }
+
+  next = rcu_dereference(list_next_rcu((struct list_head*)v));
+  (*pos)++;
+
+  // End of this shard, carry on with the next non-empty one
+  while (next == &shards[i].list) {
+    if (++i == nr_shards) {
+      next = NULL;
+      break;
+    }
+
+    next = rcu_dereference(list_next_rcu(&shards[i].list));
+  }
+
+  cursor->node = next;
+  cursor->shard = i;
+  cursor->pos = *pos;
+  return cursor->node;
+}
+
+static void modlist_seq_stop(struct seq_file* m, void* v)
+    __releases(RCU) {
+  rcu_read_unlock();
+}
+
+static int modlist_seq_show(struct seq_file* m, void* v) {
+  list_private_t* priv = m->private;
+  struct list_item_t* item;
+
+  if (v == SEQ_START_TOKEN) {
+    seq_printf(m, "%d\n", priv->answer == ANSWER_FOUND);
     return 0;
   }
 
-  to_copy = size <= len ? size : len;
-  if (copy_to_user(buf, &own_buffer, to_copy)) {
-    return -EFAULT;
+  item = list_entry(v, struct list_item_t, links);
+  seq_printf(m, "%i\n", item->data);
+  return 0;
+}
+
+static const struct seq_operations modlist_seq_ops = {
+  .start = modlist_seq_start,
+  .next = modlist_seq_next,
+  .stop = modlist_seq_stop,
+  .show = modlist_seq_show
+};
+
+static int modlist_open(struct inode* inode, struct file* fd) {
+  list_private_t* priv;
+
+  priv = __seq_open_private(fd, &modlist_seq_ops, sizeof(list_private_t));
+  if (priv == NULL) {
+    return -ENOMEM;
+  }
+
+  mutex_init(&priv->lock);
+  return 0;
+}
+
+static int count_op(list_cmd_t cmd, int data, void* ctx) {
+  list_batch_t* batch = ctx;
+  if (cmd == CMD_ADD) {
+    batch->nr_adds++;
+  }
+
+  return 0;
+}
+
+static void batch_unlock(list_batch_t* batch) {
+  if (batch->locked) {
+    spin_unlock(&batch->home->lock);
+    batch->locked = false;
+  }
+}
+
+// Adds keep the home shard locked until the batch needs another lock
+static int apply_op(list_cmd_t cmd, int data, void* ctx) {
+  list_item_t* item;
+  list_batch_t* batch = ctx;
+  int shard = -1;
+
+  switch (cmd) {
+  case CMD_ADD:
+    item = list_first_entry(&batch->spare, list_item_t, links);
+    list_del(&item->links);
+    item->data = data;
+    shard = batch->home - shards;
+
+    if (append) {
+      llist_add(&item->stage, &batch->home->staged);
+      break;
+    }
+
+    if (!batch->locked) {
+      spin_lock(&batch->home->lock);
+      batch->locked = true;
+    }
+
+    __add_item(batch->home, item);
+    break;
+  case CMD_REMOVE:
+    batch_unlock(batch);
+    remove_item(data);
+    break;
+  case CMD_CONTAINS:
+    batch->answer = max_t(list_answer_t, batch->answer,
+                          contains_item(data) ? ANSWER_FOUND : ANSWER_MISSING);
+    break;
+  case CMD_CLEANUP:
+    batch_unlock(batch);
+    cleanup();
+    break;
+  default:
+    return -EINVAL;
+  }
+
+  trace_modlist_op(cmd, data, shard);
+  return 0;
+}
+
+// Validate a chunk of commands and apply it, all its adds going to the
+// shard of the current CPU. With `last` set, whatever the parser still carries is
+// applied too. A malformed chunk changes nothing and resets the parser
+static int apply_chunk(list_parser_t* parser, const char* buffer, size_t len,
+                       bool last, list_answer_t* answer) {
+  int ret;
+  list_parser_t check = *parser;
+  list_batch_t batch = {.nr_adds = 0, .answer = ANSWER_NONE, .locked = false};
+
+  INIT_LIST_HEAD(&batch.spare);
+
+  ret = parse_batch(&check, buffer, len, count_op, &batch);
+  if (ret == 0 && last) {
+    ret = parse_end(&check, count_op, &batch);
+  }
+
+  if (ret != 0) {
+    *parser = (list_parser_t){.cmd = CMD_NONE};
+    return ret;
+  }
+
+  ret = list_items_alloc(&batch.spare, batch.nr_adds);
+  if (ret != 0) {
+    return ret;
   }
-  (*off) += to_copy;
-  return to_copy;
+
+  batch.home = &shards[raw_smp_processor_id() % nr_shards];
+  parse_batch(parser, buffer, len, apply_op, &batch);
+  if (last) {
+    parse_end(parser, apply_op, &batch);
+  }
+  batch_unlock(&batch);
+
+  list_items_free(&batch.spare);
+
+  *answer = max_t(list_answer_t, *answer, batch.answer);
+
+  return 0;
 }
 
+// Commands may span several writes, so `cat` of a large command file works
+// no matter how it splits its writes. The input is consumed in place one
+// chunk at a time, lines cut at the end of a write are completed by the
+// next one or applied on close. A contains rewinds the file, so the next
+// read() returns its answer
 static ssize_t modlist_write(struct file* fd, const char __user* buf,
                              size_t len, loff_t* off) {
 
-  int data;
-  char own_buffer[READ_BUF_LEN];
+  int ret = 0;
+  size_t chunk_len;
+  size_t consumed = 0;
+  list_answer_t answer = ANSWER_NONE;
+  struct seq_file* m = fd->private_data;
+  list_private_t* priv = m->private;
 
-  if (copy_from_user(own_buffer, buf, len)) {
-    return -EFAULT;
+  trace_modlist_write(len);
+
+  mutex_lock(&priv->lock);
+
+  if (priv->chunk == NULL) {
+    priv->chunk = kmalloc(WRITE_CHUNK_LEN, GFP_KERNEL);
+    if (priv->chunk == NULL) {
+      ret = -ENOMEM;
+      goto out;
+    }
   }
 
-  printk(KERN_ALERT "Modlist: Calling write\n");
+  while (consumed < len) {
+    chunk_len = min_t(size_t, len - consumed, WRITE_CHUNK_LEN);
+    if (copy_from_user(priv->chunk, buf + consumed, chunk_len)) {
+      ret = -EFAULT;
+      goto out;
+    }
 
-  own_buffer[len] = '\0';
+    ret = apply_chunk(&priv->parser, priv->chunk, chunk_len, false, &answer);
+    if (ret != 0) {
+      goto out;
+    }
 
-  if (scanadd(own_buffer, &data)) {
-    add_item(llist, data);
-  } else if (scanremove(own_buffer, &data)) {
-    remove_item(llist, data);
-  } else if (scancleanup(own_buffer)) {
-    cleanup(llist);
+    consumed += chunk_len;
   }
 
-  return len;
+  if (answer != ANSWER_NONE) {
+    priv->answer = answer;
+    *off = 0;
+  }
+
+  ret = len;
+
+out:
+  mutex_unlock(&priv->lock);
+  return ret;
+}
+
+// Apply the last command if the writer didn't end it with a newline
+static int modlist_release(struct inode* inode, struct file* fd) {
+  list_answer_t answer = ANSWER_NONE;
+  struct seq_file* m = fd->private_data;
+  list_private_t* priv = m->private;
+
+  if (priv->chunk != NULL) {
+    apply_chunk(&priv->parser, NULL, 0, true, &answer);
+    kfree(priv->chunk);
+  }
+
+  return seq_release_private(inode, fd);
 }
 
 static const struct file_operations proc_entry_fops = {
-  .read = modlist_read,
-  .write = modlist_write
+  .open = modlist_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .write = modlist_write,
+  .release = modlist_release
 };
 
 int init_modlist_module(void) {
-  llist = list_head_init();
-  INIT_LIST_HEAD(llist);
+  item_cache = kmem_cache_create("modlist_item", sizeof(list_item_t), 0, 0,
+                                 NULL);
+  if (item_cache == NULL) {
+    printk(KERN_INFO "Modlist: Can't create item cache\n");
+    return -ENOMEM;
+  }
+
+  if (shards_init() != 0) {
+    kmem_cache_destroy(item_cache);
+    printk(KERN_INFO "Modlist: Can't allocate the list shards\n");
+    return -ENOMEM;
+  }
 
   proc_entry = proc_create("modlist", 0666, NULL, &proc_entry_fops);
   if (proc_entry == NULL) {
+    shards_free();
+    kmem_cache_destroy(item_cache);
     printk(KERN_INFO "Modlist: Can't create /proc entry\n");
     return -ENOMEM;
   } else {
-    printk(KERN_INFO "Modlist: Module loaded\n");
+    printk(KERN_INFO "Modlist: Module loaded with %u shard(s)\n", nr_shards);
   }
 
   return 0;
 }
 
 void exit_modlist_module(void) {
-  cleanup(llist);
-  vfree(llist);
-
   remove_proc_entry("modlist", NULL);
 
+  cleanup();
+  shards_free();
+
+  // Wait for the pending free_item_rcu callbacks before the cache goes away
+  rcu_barrier();
+  kmem_cache_destroy(item_cache);
+
   printk(KERN_INFO "Modlist: Module unloaded.\n");
 }
 
@@ -123,96 +535,376 @@ void exit_modlist_module(void) {
 //  UTIL FUNCTIONS  //
 //////////////////////
 
-struct list_head* list_head_init(void) {
-  struct list_head* head;
+int shards_init(void) {
+  unsigned int i;
+  unsigned int bucket;
+  list_shard_t* shard;
+
+  nr_shards = sharded ? nr_cpu_ids : 1;
+  shard_hash_bits = max_t(unsigned int,
+                          ITEM_HASH_BITS - order_base_2(nr_shards),
+                          SHARD_HASH_MIN_BITS);
+
+  shards = kcalloc(nr_shards, sizeof(list_shard_t), GFP_KERNEL);
+  if (shards == NULL) {
+    return -ENOMEM;
+  }
+
+  for (i = 0; i < nr_shards; i++) {
+    shard = &shards[i];
+    spin_lock_init(&shard->lock);
+    INIT_LIST_HEAD(&shard->list);
+    init_llist_head(&shard->staged);
+
+    shard->table = vmalloc(sizeof(struct hlist_head) << shard_hash_bits);
+    if (shard->table == NULL) {
+      shards_free();
+      return -ENOMEM;
+    }
+
+    for (bucket = 0; bucket < (1U << shard_hash_bits); bucket++) {
+      INIT_HLIST_HEAD(&shard->table[bucket]);
+    }
+  }
+
+  return 0;
+}
+
+// Shards must be empty
+void shards_free(void) {
+  unsigned int i;
 
-  head = (struct list_head*)vmalloc((sizeof(struct list_head)));
-  memset(head, 0, sizeof(struct list_head));
+  for (i = 0; i < nr_shards; i++) {
+    vfree(shards[i].table);
+  }
+
+  kfree(shards);
+  shards = NULL;
+}
 
-  return (struct list_head*)head;
+static inline struct hlist_head* shard_bucket(list_shard_t* shard, int data) {
+  return &shard->table[hash_min(data, shard_hash_bits)];
 }
 
 struct list_item_t* list_item_init(struct list_item_t data) {
   struct list_item_t* item;
-  item = (struct list_item_t*)vmalloc((sizeof(struct list_item_t)));
-  memset(item, 0, sizeof(struct list_item_t));
+  item = kmem_cache_alloc(item_cache, GFP_KERNEL);
+  if (item == NULL) {
+    return NULL;
+  }
+
   memcpy(item, &data, sizeof(struct list_item_t));
-  return (struct list_item_t*)item;
+  return item;
 }
 
-int print_list(struct list_head* list, char* buf) {
-  int buf_len = 0;
-  int read_bytes = 0;
+int list_items_alloc(struct list_head* spare, int count) {
+  list_item_t* item;
 
-  struct list_head* cur_node = NULL;
-  struct list_item_t* item = NULL;
+  while (count-- > 0) {
+    item = list_item_init((struct list_item_t){.data = 0});
+    if (item == NULL) {
+      list_items_free(spare);
+      return -ENOMEM;
+    }
 
-  spin_lock(&sp);
-  list_for_each(cur_node, list) {
-    item = list_entry(cur_node, struct list_item_t, links);
-    read_bytes = sprintf(buf, "%i\n", item->data);
-    if (read_bytes == -1) {
-      return read_bytes;
+    list_add(&item->links, spare);
+  }
+
+  return 0;
+}
+
+void list_items_free(struct list_head* spare) {
+  list_item_t* item = NULL;
+  list_item_t* aux_storage = NULL;
+
+  list_for_each_entry_safe(item, aux_storage, spare, links) {
+    list_del(&item->links);
+    free_item(item);
+  }
+}
+
+// Hand-rolled replacement for sscanf("%i"), accepts an optional sign
+// followed by decimal digits
+int parse_int(const char* token, size_t len, int* container) {
+  size_t i = 0;
+  bool negative = false;
+  s64 value = 0;
+
+  if (len > 0 && (token[0] == '-' || token[0] == '+')) {
+    negative = (token[0] == '-');
+    i++;
+  }
+
+  if (i == len) {
+    return -EINVAL;
+  }
+
+  for (; i < len; i++) {
+    if (token[i] < '0' || token[i] > '9') {
+      return -EINVAL;
+    }
+
+    value = value * 10 + (token[i] - '0');
+    if (value > (s64)INT_MAX + 1) {
+      return -EINVAL;
+    }
+  }
+
+  value = negative ? -value : value;
+  if (value > INT_MAX) {
+    return -EINVAL;
+  }
+
+  *container = (int)value;
+  return 0;
+}
+
+list_cmd_t parse_keyword(const char* token, size_t len) {
+  if (len == 3 && memcmp(token, "add", 3) == 0) {
+    return CMD_ADD;
+  } else if (len == 6 && memcmp(token, "remove", 6) == 0) {
+    return CMD_REMOVE;
+  } else if (len == 8 && memcmp(token, "contains", 8) == 0) {
+    return CMD_CONTAINS;
+  } else if (len == 7 && memcmp(token, "cleanup", 7) == 0) {
+    return CMD_CLEANUP;
+  }
+
+  return CMD_NONE;
+}
+
+static int parse_token(list_parser_t* parser, const char* token, size_t len,
+                       list_op_fn fn, void* ctx) {
+  int ret;
+  int data;
+
+  // First token of a line, figure out the command
+  if (parser->cmd == CMD_NONE) {
+    parser->cmd = parse_keyword(token, len);
+    parser->nr_values = 0;
+    if (parser->cmd == CMD_NONE) {
+      return -EINVAL;
+    }
+
+    return (parser->cmd == CMD_CLEANUP) ? fn(CMD_CLEANUP, 0, ctx) : 0;
+  }
+
+  // cleanup takes no values
+  if (parser->cmd == CMD_CLEANUP) {
+    return -EINVAL;
+  }
+
+  ret = parse_int(token, len, &data);
+  if (ret != 0) {
+    return ret;
+  }
+
+  parser->nr_values++;
+  return fn(parser->cmd, data, ctx);
+}
+
+static inline bool is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline bool is_delimiter(char c) {
+  return c == '\n' || is_blank(c);
+}
+
+// Feed `len` bytes of commands to the tokenizer, calling `fn` for every
+// value found. A token that reaches the end of the buffer is kept in the
+// parser, as it may continue in the next one. Returns 0, or the first
+// error found
+int parse_batch(list_parser_t* parser, const char* buffer, size_t len,
+                list_op_fn fn, void* ctx) {
+  int ret;
+  size_t i = 0;
+  size_t start;
+
+  while (i < len) {
+    if (is_delimiter(buffer[i])) {
+      // Finish the token carried over from the previous buffer
+      if (parser->token_len > 0) {
+        ret = parse_token(parser, parser->token, parser->token_len, fn, ctx);
+        parser->token_len = 0;
+        if (ret != 0) {
+          return ret;
+        }
+      }
+
+      if (buffer[i] == '\n') {
+        ret = parse_eol(parser);
+        if (ret != 0) {
+          return ret;
+        }
+      }
+
+      i++;
+      continue;
     }
 
-    buf += read_bytes;
-    buf_len += read_bytes;
+    start = i;
+    while (i < len && !is_delimiter(buffer[i])) {
+      i++;
+    }
+
+    if (i == len || parser->token_len > 0) {
+      if (parser->token_len + (i - start) > MAX_TOKEN_LEN) {
+        return -EINVAL;
+      }
+
+      memcpy(parser->token + parser->token_len, buffer + start, i - start);
+      parser->token_len += i - start;
+    } else {
+      ret = parse_token(parser, buffer + start, i - start, fn, ctx);
+      if (ret != 0) {
+        return ret;
+      }
+    }
   }
-  spin_unlock(&sp);
 
-  return buf_len;
+  return 0;
 }
 
-int scancleanup(const char* buffer) {
-  return (0 == strncmp(buffer, "cleanup", 7));
+// Terminates the current line, commands other than cleanup need a value
+int parse_eol(list_parser_t* parser) {
+  list_cmd_t cmd = parser->cmd;
+
+  parser->cmd = CMD_NONE;
+  if (cmd != CMD_NONE && cmd != CMD_CLEANUP && parser->nr_values == 0) {
+    return -EINVAL;
+  }
+
+  return 0;
 }
 
-int scanadd(const char* buffer, void* container) {
-  const char* format = "add %i";
-  return sscanf(buffer, format, container);
+// End of input, flush the carried token and terminate the last line
+int parse_end(list_parser_t* parser, list_op_fn fn, void* ctx) {
+  int ret = 0;
+
+  if (parser->token_len > 0) {
+    ret = parse_token(parser, parser->token, parser->token_len, fn, ctx);
+    parser->token_len = 0;
+  }
+
+  if (ret == 0) {
+    ret = parse_eol(parser);
+  }
+
+  return ret;
 }
 
-int scanremove(const char* buffer, void* container) {
-  const char* format = "remove %i";
-  return sscanf(buffer, format, container);
+// Caller must hold shard->lock
+void __add_item(list_shard_t* shard, list_item_t* item) {
+  list_add_tail_rcu(&item->links, &shard->list);
+  hlist_add_head_rcu(&item->hlinks, shard_bucket(shard, item->data));
 }
 
-void add_item(struct list_head* list, int data) {
-  struct list_item_t* new_item;
-  new_item = list_item_init((struct list_item_t){.data = data});
-  spin_lock(&sp);
-  list_add_tail(&new_item->links, list);
-  spin_unlock(&sp);
+// Caller must hold shard->lock
+void __drain_shard(list_shard_t* shard) {
+  struct llist_node* staged;
+  list_item_t* item = NULL;
+  list_item_t* aux_storage = NULL;
+
+  if (llist_empty(&shard->staged)) {
+    return;
+  }
+
+  // llist is LIFO, reverse it to link the nodes in the order they came
+  staged = llist_reverse_order(llist_del_all(&shard->staged));
+  llist_for_each_entry_safe(item, aux_storage, staged, stage) {
+    __add_item(shard, item);
+  }
 }
 
-void cleanup(struct list_head* list) {
+void drain_shards(void) {
+  unsigned int i;
+
+  if (!append) {
+    return;
+  }
+
+  for (i = 0; i < nr_shards; i++) {
+    if (!llist_empty(&shards[i].staged)) {
+      spin_lock(&shards[i].lock);
+      __drain_shard(&shards[i]);
+      spin_unlock(&shards[i].lock);
+    }
+  }
+}
+
+void cleanup(void) {
+  unsigned int i;
+
+  for (i = 0; i < nr_shards; i++) {
+    spin_lock(&shards[i].lock);
+    __drain_shard(&shards[i]);
+    __cleanup(&shards[i]);
+    spin_unlock(&shards[i].lock);
+  }
+}
+
+// Caller must hold shard->lock
+void __cleanup(list_shard_t* shard) {
   struct list_head* cur_node = NULL;
   struct list_head* aux_storage = NULL;
   struct list_item_t* item = NULL;
 
-  spin_lock(&sp);
-  list_for_each_safe(cur_node, aux_storage, llist) {
+  atomic_long_inc(&list_gen);
+  list_for_each_safe(cur_node, aux_storage, &shard->list) {
     item = list_entry(cur_node, struct list_item_t, links);
-    list_del(cur_node);
-    vfree(item);
+    list_del_rcu(cur_node);
+    hlist_del_init_rcu(&item->hlinks);
+    call_rcu(&item->rcu, free_item_rcu);
   }
-  spin_unlock(&sp);
 }
 
-void remove_item(struct list_head* list, int data) {
-  struct list_head* cur_node = NULL;
-  struct list_head* aux_storage = NULL;
+void remove_item(int data) {
+  unsigned int i;
+
+  for (i = 0; i < nr_shards; i++) {
+    spin_lock(&shards[i].lock);
+    __drain_shard(&shards[i]);
+    __remove_item(&shards[i], data);
+    spin_unlock(&shards[i].lock);
+  }
+}
+
+// Caller must hold shard->lock
+void __remove_item(list_shard_t* shard, int data) {
+  struct hlist_node* aux_storage = NULL;
   struct list_item_t* item = NULL;
 
-  spin_lock(&sp);
-  list_for_each_safe(cur_node, aux_storage, llist) {
-    item = list_entry(cur_node, struct list_item_t, links);
+  hlist_for_each_entry_safe(item, aux_storage, shard_bucket(shard, data),
+                            hlinks) {
     if (match_item(item, data)) {
-      list_del(cur_node);
-      free_item(item);
+      hlist_del_init_rcu(&item->hlinks);
+      list_del_rcu(&item->links);
+      atomic_long_inc(&list_gen);
+      call_rcu(&item->rcu, free_item_rcu);
+    }
+  }
+}
+
+bool contains_item(int data) {
+  unsigned int i;
+  bool found = false;
+  struct list_item_t* item = NULL;
+
+  drain_shards();
+
+  rcu_read_lock();
+  for (i = 0; i < nr_shards && !found; i++) {
+    hlist_for_each_entry_rcu(item, shard_bucket(&shards[i], data), hlinks) {
+      if (match_item(item, data)) {
+        found = true;
+        break;
+      }
     }
   }
-  spin_unlock(&sp);
+  rcu_read_unlock();
+
+  return found;
 }
 
 bool match_item(list_item_t* item, int data) {
@@ -220,7 +912,13 @@ bool match_item(list_item_t* item, int data) {
 }
 
 void free_item(list_item_t* item) {
-  vfree(item);
+  kmem_cache_free(item_cache, item);
+}
+
+// kfree_rcu can't be used on objects that come from a kmem_cache,
+// so release them through an explicit callback instead
+void free_item_rcu(struct rcu_head* head) {
+  free_item(container_of(head, list_item_t, rcu));
 }
 
 module_init(init_modlist_module);
@@ -2,13 +2,34 @@
 #include <linux/module.h>
 #include <linux/proc_fs.h>
 #include <linux/kfifo.h>
-#include <linux/semaphore.h>
-#include <asm-generic/uaccess.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/moduleparam.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/uaccess.h>
+
+#define CREATE_TRACE_POINTS
+#include "fifoproc_trace.h"
 
 MODULE_LICENSE("GPL");
 
-#define MAX_FIFO_SIZE 64 // 64 bytes, fits 64 chars
-#define MAX_BUFFER_SIZE 64
+// Bounds of the fifo_size parameter
+#define MIN_FIFO_SIZE 64
+#define MAX_FIFO_SIZE (16 << 20)
+
+// Transfers copy up to this many bytes between user memory and the ring
+// per fifo_lock hold. Writes up to this size (or fifo_size, if smaller)
+// are atomic, like PIPE_BUF ones on a pipe
+#define MAX_BUFFER_SIZE PAGE_SIZE
+
+static unsigned int fifo_size = 65536;
+
+module_param(fifo_size, uint, 0000);
+MODULE_PARM_DESC(fifo_size, "Capacity of the FIFO in bytes, a power of two");
 
 static int fifoproc_open(struct inode *, struct file *);
 static int fifoproc_release(struct inode *, struct file *);
@@ -16,16 +37,17 @@ static int fifoproc_release(struct inode *, struct file *);
 static ssize_t fifoproc_read(struct file *, char *, size_t, loff_t *);
 static ssize_t fifoproc_write(struct file *, const char *, size_t, loff_t *);
 
-// Circular buffer and associated lock
+// Circular buffer, open counts and the lock protecting them all
 static struct kfifo cbuffer;
-static struct semaphore mtx;
+static char* cbuffer_storage;
+static DEFINE_SPINLOCK(fifo_lock);
 
 // Opened process count
 int reader_opens, writer_opens;
 
-// Read & write queues and associated sizes
-int reader_waiting, writer_waiting;
-static struct semaphore read_queue, write_queue;
+// Readers wait for data or a writer, writers for room or a reader
+static DECLARE_WAIT_QUEUE_HEAD(readers_wq);
+static DECLARE_WAIT_QUEUE_HEAD(writers_wq);
 
 static struct proc_dir_entry* proc_entry;
 static const struct file_operations proc_entry_fops = {
@@ -35,92 +57,81 @@ static const struct file_operations proc_entry_fops = {
     .release = fifoproc_release
 };
 
+// Wait conditions, checked under fifo_lock and again locklessly by
+// wait_event_interruptible before sleeping
+
+static bool has_writers(void) {
+    return writer_opens > 0;
+}
+
+static bool has_readers(void) {
+    return reader_opens > 0;
+}
+
+// There's data to read, or there won't be any more
+static bool can_read(void) {
+    return !kfifo_is_empty(&cbuffer) || writer_opens == 0;
+}
+
+// There's room for `room` bytes, or no one will ever read them
+static bool can_write(size_t room) {
+    return kfifo_avail(&cbuffer) >= room || reader_opens == 0;
+}
+
 static int fifoproc_open(struct inode *inode, struct file *fd) {
     fmode_t mode = fd->f_mode;
     unsigned int flags = fd->f_flags;
 
     // In either mode, wait until we meet with the other side
     if (mode & FMODE_READ) {
-        int private_writers;
-        printk(KERN_INFO "fifoproc: Open reader mode\n");
-
-        // Fenced atomic incr and fetch
-        if (down_interruptible(&mtx)) return -EINTR;
+        u64 start = ktime_get_ns();
 
+        spin_lock(&fifo_lock);
         reader_opens++;
-        private_writers = writer_opens;
-
-        up(&mtx);
 
         // If file is opened in non-blocking mode and this call would block
         // return EAGAIN
-        if ((flags & O_NONBLOCK) && (private_writers == 0)) {
+        if ((flags & O_NONBLOCK) && !has_writers()) {
+            reader_opens--;
+            spin_unlock(&fifo_lock);
             return -EAGAIN;
         }
+        spin_unlock(&fifo_lock);
 
-        printk(
-            KERN_INFO "fifoproc: cached writers on the other side: %i\n",
-            private_writers
-        );
-
-        up(&write_queue);
-        while (private_writers == 0) {
-            printk(KERN_INFO "fifproc: Waiting for writers to meet...\n");
-            if (down_interruptible(&read_queue)) {
-                down(&mtx);
-                reader_opens--;
-                up(&mtx);
-                return -EINTR;
-            }
-
-            // Refresh
-            if (down_interruptible(&mtx)) return -EINTR;
-            private_writers = writer_opens;
-            up(&mtx);
+        wake_up_interruptible(&writers_wq);
+        if (wait_event_interruptible(readers_wq, has_writers())) {
+            spin_lock(&fifo_lock);
+            reader_opens--;
+            spin_unlock(&fifo_lock);
+            return -EINTR;
         }
 
-        printk(KERN_INFO "fifoproc: Reader matched with writer\n");
+        trace_fifoproc_open(true, writer_opens, ktime_get_ns() - start);
 
     } else {
-        int private_readers;
-        printk(KERN_INFO "fifoproc: Open writer mode\n");
-
-        // Fenced atomic incr and fetch
-        if (down_interruptible(&mtx)) return -EINTR;
+        u64 start = ktime_get_ns();
 
+        spin_lock(&fifo_lock);
         writer_opens++;
-        private_readers = reader_opens;
-
-        up(&mtx);
 
         // If file is opened in non-blocking mode and this call would block
         // return EAGAIN
-        if ((flags & O_NONBLOCK) && (private_readers == 0)) {
+        if ((flags & O_NONBLOCK) && !has_readers()) {
+            writer_opens--;
+            spin_unlock(&fifo_lock);
             return -EAGAIN;
         }
+        spin_unlock(&fifo_lock);
 
-        printk(
-            KERN_INFO "fifoproc: cached readers on the other side: %i\n",
-            private_readers
-        );
-
-        up(&read_queue);
-        while (private_readers == 0) {
-            printk(KERN_INFO "fifoproc: Waiting for readers to meet...\n");
-            if (down_interruptible(&write_queue)) {
-                down(&mtx);
-                writer_opens--;
-                up(&mtx);
-                return -EINTR;
-            }
-
-            // Refresh
-            if (down_interruptible(&mtx)) return -EINTR;
-            private_readers = reader_opens;
-            up(&mtx);
+        wake_up_interruptible(&readers_wq);
+        if (wait_event_interruptible(writers_wq, has_readers())) {
+            spin_lock(&fifo_lock);
+            writer_opens--;
+            spin_unlock(&fifo_lock);
+            return -EINTR;
         }
 
-        printk(KERN_INFO "fifoproc: Writer matched with reader\n");
+        trace_fifoproc_open(false, reader_opens, ktime_get_ns() - start);
     }
 
     return 0;
@@ -128,195 +139,226 @@ static int fifoproc_open(struct inode *inode, struct file *fd) {
 
 static int fifoproc_release(struct inode *inode, struct file *fd) {
     fmode_t mode = fd->f_mode;
+
+    spin_lock(&fifo_lock);
     if (mode & FMODE_READ) {
-        printk(KERN_INFO "fifoproc: Close reader mode\n");
-        if (down_interruptible(&mtx)) return -EINTR;
         reader_opens--;
-
-        // Signal writers that we're leaving
-        up(&write_queue);
-
-        // If we're the last one, flush fifo
-        if (reader_opens == 0 && writer_opens == 0) {
-            kfifo_reset(&cbuffer);
-        }
-        up(&mtx);
     } else {
-        printk(KERN_INFO "fifoproc: Close writer mode\n");
-        if (down_interruptible(&mtx)) return -EINTR;
         writer_opens--;
+    }
 
-        // Signal writers that we're leaving
-        up(&read_queue);
+    // If we're the last one, flush fifo
+    if (reader_opens == 0 && writer_opens == 0) {
+        kfifo_reset(&cbuffer);
+    }
+    trace_fifoproc_release(mode & FMODE_READ, reader_opens, writer_opens);
+    spin_unlock(&fifo_lock);
 
-        // If we're the last one, flush fifo
-        if (reader_opens == 0 && writer_opens == 0) {
-            kfifo_reset(&cbuffer);
-        }
-        up(&mtx);
+    // Signal the other side that we're leaving
+    if (mode & FMODE_READ) {
+        wake_up_interruptible(&writers_wq);
+    } else {
+        wake_up_interruptible(&readers_wq);
     }
 
     return 0;
 }
 
+// Like a pipe, wait for some data and return as much of it as fits in
+// `len`, 0 once it's empty and every writer is gone.
+//
+// Data goes straight from the ring to `buf`. The copy runs under
+// fifo_lock with page faults disabled, a page that isn't there is faulted
+// in with the lock dropped and the copy retried
 static ssize_t fifoproc_read(struct file *fd, char __user *buf, size_t len, loff_t *off) {
-    int bytes_extracted;
-    char own_buffer[MAX_BUFFER_SIZE];
+    int ret = 0;
+    size_t done = 0;
+    unsigned int copied;
+    unsigned int used;
+    u64 start = ktime_get_ns();
 
-    printk(KERN_INFO "fifoproc: Reading file\n");
-
-    // If trying to read with size larger than kfifo max size, return error
-    if (len > MAX_FIFO_SIZE || len > MAX_BUFFER_SIZE) {
-        return -ENOSPC;
+    if (len == 0) {
+        return 0;
     }
 
-    if (down_interruptible(&mtx)) return -EINTR;
-
-    // If trying to read with size less than kfifo size,
-    // block caller with read_queue
-    //
-    // we can do the comparison directly since we store chars
-    while (kfifo_len(&cbuffer) < len && writer_opens > 0) {
-        reader_waiting++;
-        up(&mtx);
-
-        printk(
-            KERN_INFO "fifoproc: Buffer not full enough, will wait until there's enough\n"
-        );
+    spin_lock(&fifo_lock);
+    while (!can_read()) {
+        spin_unlock(&fifo_lock);
 
-        if (down_interruptible(&read_queue)) {
-            down(&mtx);
-            reader_waiting--;
-            up(&mtx);
+        if (wait_event_interruptible(readers_wq, can_read())) {
             return -EINTR;
         }
 
-        printk(KERN_INFO "fifoproc: Reader awoke, will check buffer again\n");
-
-        if (down_interruptible(&mtx)) return -EINTR;
+        spin_lock(&fifo_lock);
     }
 
-    // If trying to read from empty kfifo, and no writers are present,
-    // return 0 (EOF)
-    if (kfifo_is_empty(&cbuffer) && writer_opens == 0) {
-        up(&mtx);
-        return 0;
-    }
+    // Drain what's there without waiting for more
+    while (done < len && !kfifo_is_empty(&cbuffer)) {
+        pagefault_disable();
+        ret = kfifo_to_user(&cbuffer, buf + done,
+                            min_t(size_t, len - done, MAX_BUFFER_SIZE), &copied);
+        pagefault_enable();
+        spin_unlock(&fifo_lock);
+
+        done += copied;
+        if (copied > 0) {
+            wake_up_interruptible(&writers_wq);
+        }
 
-    bytes_extracted = kfifo_out(&cbuffer, &own_buffer, len);
+        if (ret != 0) {
+            if (fault_in_pages_writeable(buf + done,
+                                         min_t(size_t, len - done, PAGE_SIZE))) {
+                spin_lock(&fifo_lock);
+                break;
+            }
+            ret = 0;
+        }
 
-    if (writer_waiting > 0) {
-        up(&write_queue);
-        writer_waiting--;
+        spin_lock(&fifo_lock);
     }
 
-    up(&mtx);
+    used = kfifo_len(&cbuffer);
+    spin_unlock(&fifo_lock);
 
-    if (copy_to_user(buf, own_buffer, len)) {
-        return -EFAULT;
+    trace_fifoproc_read(done, used, ktime_get_ns() - start);
+
+    if (done == 0) {
+        return ret;
     }
 
-    *off += len;
-    return len;
+    *off += done;
+    return done;
 }
 
+// Like a pipe, block until all `len` bytes are in, streaming them into
+// the ring as readers make room. Short writes only happen on errors.
+//
+// Data goes straight from `buf` to the ring, faults are handled as in
+// fifoproc_read. Atomic writes are staged in a kernel buffer instead, so
+// a fault can't leave half of them in the ring
 static ssize_t fifoproc_write(struct file *fd, const char __user *buf, size_t len, loff_t *off) {
-    int bytes_written;
-    char own_buffer[MAX_BUFFER_SIZE + 1];
+    int ret = 0;
+    size_t done = 0;
+    unsigned int copied;
+    unsigned int used = 0;
+    char* own_buffer = NULL;
+    u64 start = ktime_get_ns();
 
-    printk(KERN_INFO "fifoproc: Writing file\n");
+    // Room to wait for, all of it for atomic writes
+    size_t room = (len <= min_t(size_t, MAX_BUFFER_SIZE, fifo_size)) ? len : 1;
 
-    // If trying to write with size larger than kfifo max size, return error
-    if (len > MAX_FIFO_SIZE || len > MAX_BUFFER_SIZE) {
-        return -ENOSPC;
+    if (len == 0) {
+        return 0;
     }
 
-    if (copy_from_user(own_buffer, buf, len)) {
-        return -EFAULT;
-    }
+    if (room == len) {
+        own_buffer = kmalloc(len, GFP_KERNEL);
+        if (own_buffer == NULL) {
+            return -ENOMEM;
+        }
 
-    own_buffer[len] = '\0';
-    *off += len;
+        if (copy_from_user(own_buffer, buf, len)) {
+            kfree(own_buffer);
+            return -EFAULT;
+        }
+    }
 
-    if (down_interruptible(&mtx)) return -EINTR;
+    while (done < len) {
+        spin_lock(&fifo_lock);
+        while (!can_write(room)) {
+            spin_unlock(&fifo_lock);
 
-    // If there's no room in kfifo to write the entire buffer,
-    // block the caller with write_queue
-    while (kfifo_avail(&cbuffer) < len && reader_opens > 0) {
-        writer_waiting++;
-        up(&mtx);
+            if (wait_event_interruptible(writers_wq, can_write(room))) {
+                ret = -EINTR;
+                break;
+            }
 
-        printk(KERN_INFO "fifoproc: Reader present, waiting for signal\n");
+            spin_lock(&fifo_lock);
+        }
 
-        if (down_interruptible(&write_queue)) {
-            down(&mtx);
-            writer_waiting--;
-            up(&mtx);
-            return -EINTR;
+        if (ret != 0) {
+            break;
         }
 
-        printk(KERN_INFO "fifoproc: Writer awoke, will check buffer again\n");
+        // Reader exited while we waited
+        if (reader_opens == 0) {
+            spin_unlock(&fifo_lock);
+            ret = -EPIPE;
+            break;
+        }
 
-        if (down_interruptible(&mtx)) return -EINTR;
-    }
+        if (own_buffer != NULL) {
+            copied = kfifo_in(&cbuffer, own_buffer, len);
+        } else {
+            pagefault_disable();
+            ret = kfifo_from_user(&cbuffer, buf + done,
+                                  min_t(size_t, len - done, MAX_BUFFER_SIZE),
+                                  &copied);
+            pagefault_enable();
+        }
 
-    // If writing to FIFO without readers, return error
-    if (reader_opens == 0) {
-        up(&mtx);
-        printk(KERN_INFO "fifoproc: Reader exited while we waited\n");
-        // TODO: What kind of error do we return here?
-        return -1;
-    }
+        used = kfifo_len(&cbuffer);
+        spin_unlock(&fifo_lock);
 
-    bytes_written = kfifo_in(&cbuffer, own_buffer, len);
+        done += copied;
+        if (copied > 0) {
+            wake_up_interruptible(&readers_wq);
+        }
 
-    if (reader_waiting > 0) {
-        up(&read_queue);
-        reader_waiting--;
+        if (ret != 0) {
+            if (fault_in_pages_readable(buf + done,
+                                        min_t(size_t, len - done, PAGE_SIZE))) {
+                break;
+            }
+            ret = 0;
+        }
     }
 
-    up(&mtx);
+    trace_fifoproc_write(done, used, ktime_get_ns() - start);
+    kfree(own_buffer);
 
-    if (bytes_written < len) {
-        // TODO: What to do here?
-        printk(KERN_INFO "fifoproc: Couldn't write everything\n");
-        return -ENOSPC;
+    if (done == 0) {
+        return ret;
     }
 
-    return len;
+    *off += done;
+    return done;
 }
 
 int fifoproc_module_init(void) {
-    if (kfifo_alloc(&cbuffer, MAX_FIFO_SIZE, GFP_KERNEL) != 0) {
+    if (!is_power_of_2(fifo_size) || fifo_size < MIN_FIFO_SIZE ||
+        fifo_size > MAX_FIFO_SIZE) {
+        printk(KERN_INFO "fifoproc: fifo_size must be a power of two between %d and %d\n",
+               MIN_FIFO_SIZE, MAX_FIFO_SIZE);
+        return -EINVAL;
+    }
+
+    // vmalloc'ed, sizes of several MB are too large for kfifo_alloc
+    cbuffer_storage = vmalloc(fifo_size);
+    if (cbuffer_storage == NULL ||
+        kfifo_init(&cbuffer, cbuffer_storage, fifo_size) != 0) {
+        vfree(cbuffer_storage);
         printk(KERN_INFO "fifoproc: Couldn't allocate kfifo\n");
         return -ENOMEM;
     }
 
-    sema_init(&mtx, 1);
-
-    sema_init(&read_queue, 0);
-    sema_init(&write_queue, 0);
-
     reader_opens = 0;
     writer_opens = 0;
 
-    reader_waiting = 0;
-    writer_waiting = 0;
-
     proc_entry = proc_create("modfifo", 0666, NULL, &proc_entry_fops);
     if (proc_entry == NULL) {
-        kfifo_free(&cbuffer);
+        vfree(cbuffer_storage);
         printk(KERN_INFO "fifproc: Can't create /proc entry\n");
         return -ENOMEM;
     }
 
-    printk(KERN_INFO "fifproc: module loaded\n");
+    printk(KERN_INFO "fifproc: module loaded with a %u bytes fifo\n", fifo_size);
     return 0;
 }
 
 void fifoproc_module_cleanup(void) {
     remove_proc_entry("modfifo", NULL);
-    kfifo_free(&cbuffer);
+    vfree(cbuffer_storage);
     printk(KERN_INFO "fifoproc: module unloaded\n");
 }
 
@@ -0,0 +1,91 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM fifoproc
+
+#if !defined(_FIFOPROC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _FIFOPROC_TRACE_H
+
+// Tracepoints of fifoproc, all of them off by default. Enable them through
+// tracefs, for instance:
+//
+//   echo 1 > /sys/kernel/debug/tracing/events/fifoproc/enable
+//   cat /sys/kernel/debug/tracing/trace_pipe
+//
+// Wait times are in nanoseconds, taken with ktime_get_ns()
+
+#include <linux/tracepoint.h>
+
+// An open() that met the other side. `peers` is the number of processes
+// found there, `wait_ns` the time spent waiting for them
+TRACE_EVENT(fifoproc_open,
+    TP_PROTO(bool reader, int peers, u64 wait_ns),
+    TP_ARGS(reader, peers, wait_ns),
+    TP_STRUCT__entry(
+        __field(bool, reader)
+        __field(int, peers)
+        __field(u64, wait_ns)
+    ),
+    TP_fast_assign(
+        __entry->reader = reader;
+        __entry->peers = peers;
+        __entry->wait_ns = wait_ns;
+    ),
+    TP_printk("%s peers=%d wait_ns=%llu",
+              __entry->reader ? "reader" : "writer", __entry->peers,
+              __entry->wait_ns)
+);
+
+// A release(), with the processes left on each side
+TRACE_EVENT(fifoproc_release,
+    TP_PROTO(bool reader, int readers, int writers),
+    TP_ARGS(reader, readers, writers),
+    TP_STRUCT__entry(
+        __field(bool, reader)
+        __field(int, readers)
+        __field(int, writers)
+    ),
+    TP_fast_assign(
+        __entry->reader = reader;
+        __entry->readers = readers;
+        __entry->writers = writers;
+    ),
+    TP_printk("%s readers=%d writers=%d",
+              __entry->reader ? "reader" : "writer", __entry->readers,
+              __entry->writers)
+);
+
+// `len` bytes moved through the buffer, which holds `used` bytes after it.
+// `wait_ns` includes the time blocked on a full or empty buffer
+DECLARE_EVENT_CLASS(fifoproc_transfer,
+    TP_PROTO(int len, unsigned int used, u64 wait_ns),
+    TP_ARGS(len, used, wait_ns),
+    TP_STRUCT__entry(
+        __field(int, len)
+        __field(unsigned int, used)
+        __field(u64, wait_ns)
+    ),
+    TP_fast_assign(
+        __entry->len = len;
+        __entry->used = used;
+        __entry->wait_ns = wait_ns;
+    ),
+    TP_printk("len=%d used=%u wait_ns=%llu", __entry->len, __entry->used,
+              __entry->wait_ns)
+);
+
+DEFINE_EVENT(fifoproc_transfer, fifoproc_read,
+    TP_PROTO(int len, unsigned int used, u64 wait_ns),
+    TP_ARGS(len, used, wait_ns)
+);
+
+DEFINE_EVENT(fifoproc_transfer, fifoproc_write,
+    TP_PROTO(int len, unsigned int used, u64 wait_ns),
+    TP_ARGS(len, used, wait_ns)
+);
+
+#endif /* _FIFOPROC_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE fifoproc_trace
+#include <trace/define_trace.h>
@@ -3,6 +3,7 @@
 #include <linux/module.h>
 #include <linux/random.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
 #include <linux/proc_fs.h>
 #include <linux/vmalloc.h>
 #include <linux/jiffies.h>
@@ -10,6 +11,9 @@
 #include <linux/semaphore.h>
 #include <asm-generic/uaccess.h>
 
+#define CREATE_TRACE_POINTS
+#include "modtimer_trace.h"
+
 MODULE_LICENSE("GPL");
 
 // 64 bytes, fits 16 uints
@@ -53,8 +57,9 @@ void init_gen_timer(void);
 int resched_timer(void);
 static void insert_random_int(unsigned long);
 
-// Returns 1 if kfifo needs to be flushed, 0 otherwise
-int reached_threshold(void);
+// Returns 1 if kfifo needs to be flushed, 0 otherwise.
+// Stores the % of kfifo in use in `usage`
+int reached_threshold(int* usage);
 
 static struct workqueue_struct* mod_workq;
 struct work_struct transfer_task;
@@ -180,37 +185,33 @@ int resched_timer(void) {
 
 // Generate a random int and insert in the kfifo
 static void insert_random_int(unsigned long _data) {
+    int usage;
+    bool queued = false;
     unsigned int ret;
     unsigned int current_cpu, target_cpu;
     unsigned int gen = get_random_int() % max_random;
-    printk(KERN_INFO "modtimer: Generated %u\n", gen);
 
     // New API for kfifo_in with spin_lock_irqsave underneath
     ret = kfifo_in_spinlocked(&cbuffer, &gen, sizeof(unsigned int), &buffer_lock);
 
-    if (reached_threshold() == 1) {
+    if (reached_threshold(&usage) == 1) {
         current_cpu = smp_processor_id();
         target_cpu = (current_cpu == 0) ? 1 : 0;
 
-        printk(
-            KERN_INFO "modtimer: Migrating task from CPU %u to CPU %u\n",
-            current_cpu,
-            target_cpu
-        );
-
-        if (work_pending(&transfer_task)) {
-            printk(KERN_INFO "modtimer: There's still some work on the workqueue");
-        } else {
-            printk(KERN_INFO "modtimer: Will schedule flush");
-            queue_work_on(target_cpu, mod_workq, &transfer_task);
+        // If there's still some work on the workqueue it will take this too
+        if (!work_pending(&transfer_task)) {
+            queued = queue_work_on(target_cpu, mod_workq, &transfer_task);
         }
+
+        trace_modtimer_schedule(current_cpu, target_cpu, queued);
     }
 
+    trace_modtimer_generate(gen, usage);
+
     resched_timer();
 }
 
-int reached_threshold(void) {
-    float used;
+int reached_threshold(int* usage) {
     unsigned int bytes;
     unsigned long flags;
 
@@ -218,9 +219,9 @@ int reached_threshold(void) {
     bytes = kfifo_len(&cbuffer);
     spin_unlock_irqrestore(&buffer_lock, flags);
 
-    used = (float) bytes / (float) MAX_FIFO_SIZE * 100.0;
-    printk(KERN_INFO "modtimer: kfifo usage %d%%\n", (int) used);
-    return (int) used >= emergency_threshold;
+    // Integer math, there's no FPU context in timer callbacks
+    *usage = bytes * 100 / MAX_FIFO_SIZE;
+    return *usage >= emergency_threshold;
 }
 
 static void copy_items_into_list(struct work_struct* _work) {
@@ -232,7 +233,6 @@ static void copy_items_into_list(struct work_struct* _work) {
     int total_items = 0;
     unsigned int nums[COPY_BUFFER_SIZE / sizeof(unsigned int)];
 
-    printk(KERN_INFO "modtimer: Transfering numbers to linked list\n");
     do {
         bytes_extracted = kfifo_out_spinlocked(&cbuffer, &num, sizeof(unsigned int), &buffer_lock);
         if (bytes_extracted != sizeof(unsigned int)) {
@@ -243,11 +243,11 @@ static void copy_items_into_list(struct work_struct* _work) {
         }
     } while (retry != 0);
 
-    printk(KERN_INFO "modtimer: Extracted %d items from buffer\n", total_items);
     for (idx = 0; idx < total_items; idx++) {
-        printk(KERN_INFO "modtimer: Extracted %u from buffer\n", nums[idx]);
         add_item(client_list, nums[idx]);
     }
+
+    trace_modtimer_transfer(total_items);
 }
 
 int open_client(void) {
@@ -315,6 +315,7 @@ static ssize_t mod_proc_read(struct file *filp, char __user *buf, size_t len,
 
     int ret;
     char own_buffer[COPY_BUFFER_SIZE];
+    u64 start = ktime_get_ns();
 
     spin_lock(&list_lock);
 
@@ -322,19 +323,17 @@ static ssize_t mod_proc_read(struct file *filp, char __user *buf, size_t len,
         clients_waiting = 1;
         spin_unlock(&list_lock);
 
-        printk(KERN_INFO "modtimer: List is empty, sleeping\n");
-
         if (down_interruptible(&client_queue)) {
             spin_lock(&list_lock);
             clients_waiting = 0;
             spin_unlock(&list_lock);
             return -EINTR;
         }
-
-        printk(KERN_INFO "modtimer: Client awoke\n");
     }
 
     ret = print_flush_list(client_list, own_buffer);
+    trace_modtimer_read(ret, ktime_get_ns() - start);
+
     if (copy_to_user(buf, own_buffer, ret)) {
         return -EFAULT;
     }
@@ -0,0 +1,83 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM modtimer
+
+#if !defined(_MODTIMER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MODTIMER_TRACE_H
+
+// Tracepoints of modtimer, all of them off by default. Enable them
+// through tracefs, for instance:
+//
+//   echo 1 > /sys/kernel/debug/tracing/events/modtimer/enable
+//   cat /sys/kernel/debug/tracing/trace_pipe
+
+#include <linux/tracepoint.h>
+
+// The timer generated `value`, the buffer is `usage`% full after it
+TRACE_EVENT(modtimer_generate,
+    TP_PROTO(unsigned int value, int usage),
+    TP_ARGS(value, usage),
+    TP_STRUCT__entry(
+        __field(unsigned int, value)
+        __field(int, usage)
+    ),
+    TP_fast_assign(
+        __entry->value = value;
+        __entry->usage = usage;
+    ),
+    TP_printk("value=%u usage=%d%%", __entry->value, __entry->usage)
+);
+
+// The threshold was reached on `cpu`, the transfer is queued on `target`
+// unless a previous one is still pending
+TRACE_EVENT(modtimer_schedule,
+    TP_PROTO(unsigned int cpu, unsigned int target, bool queued),
+    TP_ARGS(cpu, target, queued),
+    TP_STRUCT__entry(
+        __field(unsigned int, cpu)
+        __field(unsigned int, target)
+        __field(bool, queued)
+    ),
+    TP_fast_assign(
+        __entry->cpu = cpu;
+        __entry->target = target;
+        __entry->queued = queued;
+    ),
+    TP_printk("cpu=%u target=%u queued=%d", __entry->cpu, __entry->target,
+              __entry->queued)
+);
+
+// The work moved `items` numbers from the buffer to the list
+TRACE_EVENT(modtimer_transfer,
+    TP_PROTO(int items),
+    TP_ARGS(items),
+    TP_STRUCT__entry(
+        __field(int, items)
+    ),
+    TP_fast_assign(
+        __entry->items = items;
+    ),
+    TP_printk("items=%d", __entry->items)
+);
+
+// A read() returning `bytes`, after sleeping `wait_ns` on an empty list
+TRACE_EVENT(modtimer_read,
+    TP_PROTO(int bytes, u64 wait_ns),
+    TP_ARGS(bytes, wait_ns),
+    TP_STRUCT__entry(
+        __field(int, bytes)
+        __field(u64, wait_ns)
+    ),
+    TP_fast_assign(
+        __entry->bytes = bytes;
+        __entry->wait_ns = wait_ns;
+    ),
+    TP_printk("bytes=%d wait_ns=%llu", __entry->bytes, __entry->wait_ns)
+);
+
+#endif /* _MODTIMER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE modtimer_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,696 @@
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
+
+#include "modlist.h"
+#include "modkv.h"
+#include "modkv_ioctl.h"
+#include "multilist_trace.h"
+
+// Commands accepted by /proc/kv, one per write. Keys can't contain
+// whitespace here, the ioctls in modkv_ioctl.h take any bytes:
+//
+//   put <key> <int64>
+//   putb <key> <bytes>   the rest of the write, minus a trailing newline
+//   get <key>            the value is returned by the next read()
+//   del <key>
+
+// Longest write, a putb with the longest key and value
+#define KV_WRITE_LEN (KV_MAX_KEY + KV_MAX_VALUE + 8)
+
+// Enough for the longest value, ints are printed in decimal
+#define KV_RESULT_LEN (KV_MAX_VALUE + 1)
+
+// Buckets start at 2^KV_MIN_BITS. The table doubles when there are more
+// than KV_MAX_LOAD entries per bucket, and shrinks to about one entry per
+// bucket when they fall below one every KV_MIN_LOAD buckets
+#define KV_MIN_BITS 4
+#define KV_MAX_BITS 20
+#define KV_MAX_LOAD 2
+#define KV_MIN_LOAD 8
+
+// Buckets of the previous table migrated by every operation during a
+// resize, which completes after 2^old_bits / KV_REHASH_STEP operations
+#define KV_REHASH_STEP 4
+
+typedef struct kv_entry_t {
+    struct hlist_node node;
+    u32 hash;
+    u32 type;
+    u32 key_len;
+    u32 value_len;
+    // Key followed by the value, an s64 for KV_TYPE_INT
+    char data[];
+} kv_entry_t;
+
+typedef struct kv_bucket_t {
+    spinlock_t lock;
+    // Set once the entries were migrated to the next table
+    bool moved;
+    struct hlist_head chain;
+} kv_bucket_t;
+
+typedef struct kv_table_t {
+    unsigned int bits;
+    // Table being migrated into this one, NULL once it's done
+    struct kv_table_t __rcu* old;
+    // Next bucket of `old` to migrate, and buckets migrated so far
+    atomic_t rehash_idx;
+    atomic_t rehashed;
+    kv_bucket_t buckets[];
+} kv_table_t;
+
+// Per open file state, the result of the last `get` waiting to be read
+typedef struct kv_private_t {
+    struct mutex lock;
+    char* result;
+    size_t result_len;
+} kv_private_t;
+
+// A resize publishes a table pointing to the current one as `old`, and
+// operations move the entries over a few buckets at a time. Operations
+// lock the bucket of their key in `old` unless it's been moved, in the
+// new table otherwise. Tables are freed after an RCU grace period.
+// kv_resize is the only one replacing kv_table
+static kv_table_t __rcu* kv_table;
+static struct work_struct resize_work;
+
+static atomic_t kv_count = ATOMIC_INIT(0);
+static u32 kv_seed;
+
+static struct proc_dir_entry* kv_entry;
+
+kv_table_t* kv_table_alloc(unsigned int bits);
+void kv_table_free(kv_table_t* table);
+static void kv_resize(struct work_struct* work);
+void kv_check_load(kv_table_t* table);
+void kv_rehash_step(kv_table_t* table);
+
+kv_entry_t* kv_entry_alloc(const char* key, u32 key_len, u32 type,
+                           u32 value_len);
+int kv_put(kv_entry_t* entry);
+int kv_get(const char* key, u32 key_len, u32* type, void* buf, u32 cap);
+int kv_del(const char* key, u32 key_len);
+
+static int kv_open(struct inode* inode, struct file* filp) {
+    kv_private_t* priv = kzalloc(sizeof(kv_private_t), GFP_KERNEL);
+    if (priv == NULL) {
+        return -ENOMEM;
+    }
+
+    mutex_init(&priv->lock);
+    filp->private_data = priv;
+    return 0;
+}
+
+static int kv_release(struct inode* inode, struct file* filp) {
+    kv_private_t* priv = filp->private_data;
+
+    kfree(priv->result);
+    kfree(priv);
+    return 0;
+}
+
+static ssize_t kv_read(struct file* filp, char __user* buf, size_t len,
+                       loff_t* off) {
+    ssize_t ret;
+    kv_private_t* priv = filp->private_data;
+
+    mutex_lock(&priv->lock);
+    ret = simple_read_from_buffer(buf, len, off, priv->result,
+                                  priv->result_len);
+    mutex_unlock(&priv->lock);
+
+    return ret;
+}
+
+// Text `get`, formats the value into the result buffer
+static int kv_write_get(kv_private_t* priv, const char* key, u32 key_len) {
+    int ret;
+    u32 type;
+    s64 num;
+
+    if (priv->result == NULL) {
+        priv->result = kmalloc(KV_RESULT_LEN, GFP_KERNEL);
+        if (priv->result == NULL) {
+            return -ENOMEM;
+        }
+    }
+
+    priv->result_len = 0;
+    ret = kv_get(key, key_len, &type, priv->result, KV_RESULT_LEN);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (type == KV_TYPE_INT) {
+        memcpy(&num, priv->result, sizeof(num));
+        ret = snprintf(priv->result, KV_RESULT_LEN, "%lld\n", num);
+    }
+
+    priv->result_len = ret;
+    return 0;
+}
+
+// Text `put` / `putb`, `value` is what follows the key
+static int kv_write_put(bool blob, const char* key, u32 key_len,
+                        char* value, size_t value_len) {
+    s64 num;
+    kv_entry_t* entry;
+
+    if (blob) {
+        if (value_len > 0 && value[value_len - 1] == '\n') {
+            value_len--;
+        }
+
+        if (value_len > KV_MAX_VALUE) {
+            return -ENOSPC;
+        }
+
+        entry = kv_entry_alloc(key, key_len, KV_TYPE_BLOB, value_len);
+        if (entry == NULL) {
+            return -ENOMEM;
+        }
+
+        memcpy(entry->data + key_len, value, value_len);
+        return kv_put(entry);
+    }
+
+    if (kstrtos64(strim(value), 10, &num)) {
+        return -EINVAL;
+    }
+
+    entry = kv_entry_alloc(key, key_len, KV_TYPE_INT, sizeof(num));
+    if (entry == NULL) {
+        return -ENOMEM;
+    }
+
+    memcpy(entry->data + key_len, &num, sizeof(num));
+    return kv_put(entry);
+}
+
+static ssize_t kv_write(struct file* filp, const char __user* buf,
+                        size_t len, loff_t* off) {
+    int ret;
+    char* cmd;
+    char* key;
+    char* value;
+    size_t key_len;
+    char* own_buffer;
+    kv_private_t* priv = filp->private_data;
+
+    if (len > KV_WRITE_LEN) {
+        return -ENOSPC;
+    }
+
+    own_buffer = kmalloc(len + 1, GFP_KERNEL);
+    if (own_buffer == NULL) {
+        return -ENOMEM;
+    }
+
+    if (copy_from_user(own_buffer, buf, len)) {
+        kfree(own_buffer);
+        return -EFAULT;
+    }
+
+    own_buffer[len] = '\0';
+
+    // <cmd> <key>[ <value>]
+    cmd = skip_spaces(own_buffer);
+    key = cmd + strcspn(cmd, " \t\n");
+    if (*key != '\0') {
+        *key++ = '\0';
+    }
+
+    key = skip_spaces(key);
+    key_len = strcspn(key, " \t\n");
+    value = key + key_len;
+    if (*value != '\0') {
+        *value++ = '\0';
+    }
+
+    if (key_len == 0 || key_len > KV_MAX_KEY) {
+        ret = -EINVAL;
+    } else if (strcmp(cmd, "put") == 0 || strcmp(cmd, "putb") == 0) {
+        ret = kv_write_put(cmd[3] == 'b', key, key_len, value,
+                           own_buffer + len - value);
+    } else if (strcmp(cmd, "get") == 0) {
+        mutex_lock(&priv->lock);
+        ret = kv_write_get(priv, key, key_len);
+        mutex_unlock(&priv->lock);
+    } else if (strcmp(cmd, "del") == 0) {
+        ret = kv_del(key, key_len);
+    } else {
+        ret = -EINVAL;
+    }
+
+    kfree(own_buffer);
+
+    // Reads start at the beginning of the result
+    *off = 0;
+    return (ret != 0) ? ret : len;
+}
+
+static long kv_ioctl(struct file* filp, unsigned int cmd, unsigned long arg) {
+    long ret;
+    u32 cap;
+    char* buf;
+    kv_entry_t* entry;
+    struct kv_ioc req;
+    char key[KV_MAX_KEY];
+    struct kv_ioc __user* user_req = (struct kv_ioc __user*) arg;
+
+    // Foreign ioctls, TCGETS from isatty() for one, must see -ENOTTY
+    // rather than whatever copying their argument as a kv_ioc gives
+    if (cmd != KV_IOC_PUT && cmd != KV_IOC_GET && cmd != KV_IOC_DEL) {
+        return -ENOTTY;
+    }
+
+    if (copy_from_user(&req, user_req, sizeof(req))) {
+        return -EFAULT;
+    }
+
+    if (req.key_len == 0 || req.key_len > KV_MAX_KEY) {
+        return -EINVAL;
+    }
+
+    if (copy_from_user(key, u64_to_user_ptr(req.key), req.key_len)) {
+        return -EFAULT;
+    }
+
+    switch (cmd) {
+    case KV_IOC_PUT:
+        if (!(req.type == KV_TYPE_INT && req.value_len == sizeof(s64)) &&
+            !(req.type == KV_TYPE_BLOB && req.value_len <= KV_MAX_VALUE)) {
+            return -EINVAL;
+        }
+
+        entry = kv_entry_alloc(key, req.key_len, req.type, req.value_len);
+        if (entry == NULL) {
+            return -ENOMEM;
+        }
+
+        if (copy_from_user(entry->data + req.key_len,
+                           u64_to_user_ptr(req.value), req.value_len)) {
+            kfree(entry);
+            return -EFAULT;
+        }
+
+        return kv_put(entry);
+    case KV_IOC_GET:
+        cap = min_t(u32, req.value_len, KV_MAX_VALUE);
+        buf = kmalloc(max_t(u32, cap, 1), GFP_KERNEL);
+        if (buf == NULL) {
+            return -ENOMEM;
+        }
+
+        ret = kv_get(key, req.key_len, &req.type, buf, cap);
+        if (ret >= 0) {
+            req.value_len = ret;
+            if (ret > cap) {
+                ret = -ENOSPC;
+            } else if (copy_to_user(u64_to_user_ptr(req.value), buf, ret)) {
+                ret = -EFAULT;
+            } else {
+                ret = 0;
+            }
+
+            if (ret != -EFAULT &&
+                (put_user(req.value_len, &user_req->value_len) ||
+                 put_user(req.type, &user_req->type))) {
+                ret = -EFAULT;
+            }
+        }
+
+        kfree(buf);
+        return ret;
+    case KV_IOC_DEL:
+        return kv_del(key, req.key_len);
+    default:
+        return -ENOTTY;
+    }
+}
+
+static const struct file_operations kv_fops = {
+    .open = kv_open,
+    .read = kv_read,
+    .write = kv_write,
+    .unlocked_ioctl = kv_ioctl,
+    .compat_ioctl = kv_ioctl,
+    .release = kv_release
+};
+
+int kv_init(void) {
+    kv_table_t* table;
+
+    kv_seed = get_random_int();
+    INIT_WORK(&resize_work, kv_resize);
+
+    table = kv_table_alloc(KV_MIN_BITS);
+    if (table == NULL) {
+        return -ENOMEM;
+    }
+
+    RCU_INIT_POINTER(kv_table, table);
+
+    kv_entry = proc_create("kv", 0666, NULL, &kv_fops);
+    if (kv_entry == NULL) {
+        kv_table_free(table);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+void kv_exit(void) {
+    kv_table_t* table;
+    kv_table_t* old;
+
+    remove_proc_entry("kv", NULL);
+    cancel_work_sync(&resize_work);
+
+    table = rcu_dereference_protected(kv_table, 1);
+    old = rcu_dereference_protected(table->old, 1);
+    if (old != NULL) {
+        kv_table_free(old);
+    }
+    kv_table_free(table);
+}
+
+//////////////////////
+//  UTIL FUNCTIONS  //
+//////////////////////
+
+kv_table_t* kv_table_alloc(unsigned int bits) {
+    unsigned int i;
+    kv_table_t* table;
+
+    table = vmalloc(sizeof(kv_table_t) + (sizeof(kv_bucket_t) << bits));
+    if (table == NULL) {
+        return NULL;
+    }
+
+    table->bits = bits;
+    RCU_INIT_POINTER(table->old, NULL);
+    atomic_set(&table->rehash_idx, 0);
+    atomic_set(&table->rehashed, 0);
+
+    for (i = 0; i < (1U << bits); i++) {
+        spin_lock_init(&table->buckets[i].lock);
+        table->buckets[i].moved = false;
+        INIT_HLIST_HEAD(&table->buckets[i].chain);
+    }
+
+    return table;
+}
+
+// Frees the table and every entry left in it
+void kv_table_free(kv_table_t* table) {
+    unsigned int i;
+    kv_entry_t* entry;
+    struct hlist_node* aux_storage;
+
+    for (i = 0; i < (1U << table->bits); i++) {
+        hlist_for_each_entry_safe(entry, aux_storage,
+                                  &table->buckets[i].chain, node) {
+            hlist_del(&entry->node);
+            kfree(entry);
+        }
+    }
+
+    vfree(table);
+}
+
+static inline kv_bucket_t* kv_bucket(kv_table_t* table, u32 hash) {
+    return &table->buckets[hash & ((1U << table->bits) - 1)];
+}
+
+static inline u32 kv_hash(const char* key, u32 key_len) {
+    return jhash(key, key_len, kv_seed);
+}
+
+// Caller must hold the bucket lock
+static kv_entry_t* __kv_find(kv_bucket_t* bucket, u32 hash, const char* key,
+                             u32 key_len) {
+    kv_entry_t* entry;
+
+    hlist_for_each_entry(entry, &bucket->chain, node) {
+        if (entry->hash == hash && entry->key_len == key_len &&
+            memcmp(entry->data, key, key_len) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+// Entry holding `key` with room for the value after it
+kv_entry_t* kv_entry_alloc(const char* key, u32 key_len, u32 type,
+                           u32 value_len) {
+    kv_entry_t* entry;
+
+    entry = kmalloc(sizeof(kv_entry_t) + key_len + value_len, GFP_KERNEL);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    entry->hash = kv_hash(key, key_len);
+    entry->type = type;
+    entry->key_len = key_len;
+    entry->value_len = value_len;
+    memcpy(entry->data, key, key_len);
+
+    return entry;
+}
+
+// Lock and return the bucket `hash` lives in. Caller must be in an RCU
+// read-side critical section, and stay in it until the bucket is unlocked
+static kv_bucket_t* kv_lock_bucket(u32 hash, kv_table_t** current_table) {
+    kv_table_t* table;
+    kv_table_t* old;
+    kv_bucket_t* bucket;
+
+    for (;;) {
+        table = rcu_dereference(kv_table);
+        old = rcu_dereference(table->old);
+        *current_table = table;
+
+        if (old != NULL) {
+            bucket = kv_bucket(old, hash);
+            spin_lock(&bucket->lock);
+            if (!bucket->moved) {
+                return bucket;
+            }
+            spin_unlock(&bucket->lock);
+        }
+
+        bucket = kv_bucket(table, hash);
+        spin_lock(&bucket->lock);
+        if (!bucket->moved) {
+            return bucket;
+        }
+
+        // A newer table was published meanwhile
+        spin_unlock(&bucket->lock);
+    }
+}
+
+// Migrate up to KV_REHASH_STEP buckets of table->old. Caller must be in
+// an RCU read-side critical section, holding no bucket lock
+void kv_rehash_step(kv_table_t* table) {
+    int i;
+    int idx;
+    kv_table_t* old = rcu_dereference(table->old);
+    kv_bucket_t* from;
+    kv_bucket_t* to;
+    kv_entry_t* entry;
+    struct hlist_node* aux_storage;
+
+    if (old == NULL) {
+        return;
+    }
+
+    for (i = 0; i < KV_REHASH_STEP; i++) {
+        idx = atomic_inc_return(&table->rehash_idx) - 1;
+        if (idx >= (1 << old->bits)) {
+            return;
+        }
+
+        // Always old bucket first, operations only take one
+        from = &old->buckets[idx];
+        spin_lock(&from->lock);
+        hlist_for_each_entry_safe(entry, aux_storage, &from->chain, node) {
+            to = kv_bucket(table, entry->hash);
+            spin_lock_nested(&to->lock, SINGLE_DEPTH_NESTING);
+            hlist_del(&entry->node);
+            hlist_add_head(&entry->node, &to->chain);
+            spin_unlock(&to->lock);
+        }
+        from->moved = true;
+        spin_unlock(&from->lock);
+
+        // Last one, kv_resize retires the old table
+        if (atomic_inc_return(&table->rehashed) == (1 << old->bits)) {
+            schedule_work(&resize_work);
+        }
+    }
+}
+
+// Schedule a resize if the load of the table is out of bounds
+void kv_check_load(kv_table_t* table) {
+    int count = atomic_read(&kv_count);
+    unsigned int buckets = 1U << table->bits;
+
+    if (rcu_access_pointer(table->old) != NULL) {
+        return;
+    }
+
+    if ((count > buckets * KV_MAX_LOAD && table->bits < KV_MAX_BITS) ||
+        (count < buckets / KV_MIN_LOAD && table->bits > KV_MIN_BITS)) {
+        schedule_work(&resize_work);
+    }
+}
+
+// Insert the entry, replacing any other with the same key
+int kv_put(kv_entry_t* entry) {
+    u32 hash = entry->hash;
+    kv_table_t* table;
+    kv_bucket_t* bucket;
+    kv_entry_t* old;
+
+    rcu_read_lock();
+    bucket = kv_lock_bucket(hash, &table);
+
+    old = __kv_find(bucket, hash, entry->data, entry->key_len);
+    if (old != NULL) {
+        hlist_replace_rcu(&old->node, &entry->node);
+    } else {
+        hlist_add_head(&entry->node, &bucket->chain);
+        atomic_inc(&kv_count);
+    }
+    spin_unlock(&bucket->lock);
+
+    kv_rehash_step(table);
+    if (old == NULL) {
+        kv_check_load(table);
+    }
+    rcu_read_unlock();
+
+    // `entry` is the table's now, a racing put / del may have freed it
+    trace_multilist_kv("put", hash, 0);
+    kfree(old);
+    return 0;
+}
+
+// Copy up to `cap` bytes of the value of `key` into `buf`. Returns the
+// length of the value, or -ENOENT
+int kv_get(const char* key, u32 key_len, u32* type, void* buf, u32 cap) {
+    int ret = -ENOENT;
+    u32 hash = kv_hash(key, key_len);
+    kv_table_t* table;
+    kv_bucket_t* bucket;
+    kv_entry_t* entry;
+
+    rcu_read_lock();
+    bucket = kv_lock_bucket(hash, &table);
+
+    entry = __kv_find(bucket, hash, key, key_len);
+    if (entry != NULL) {
+        memcpy(buf, entry->data + key_len, min(entry->value_len, cap));
+        *type = entry->type;
+        ret = entry->value_len;
+    }
+    spin_unlock(&bucket->lock);
+
+    kv_rehash_step(table);
+    rcu_read_unlock();
+
+    trace_multilist_kv("get", hash, ret);
+    return ret;
+}
+
+int kv_del(const char* key, u32 key_len) {
+    u32 hash = kv_hash(key, key_len);
+    kv_table_t* table;
+    kv_bucket_t* bucket;
+    kv_entry_t* entry;
+
+    rcu_read_lock();
+    bucket = kv_lock_bucket(hash, &table);
+
+    entry = __kv_find(bucket, hash, key, key_len);
+    if (entry != NULL) {
+        hlist_del(&entry->node);
+        atomic_dec(&kv_count);
+    }
+    spin_unlock(&bucket->lock);
+
+    kv_rehash_step(table);
+    if (entry != NULL) {
+        kv_check_load(table);
+    }
+    rcu_read_unlock();
+
+    trace_multilist_kv("del", hash, (entry != NULL) ? 0 : -ENOENT);
+    if (entry == NULL) {
+        return -ENOENT;
+    }
+
+    kfree(entry);
+    return 0;
+}
+
+// Publish a table twice the size of the current one or shrunk to fit the
+// entries, or retire
+// the old table once every bucket was migrated. Neither stops the
+// operations. Runs from the system workqueue, which never runs it twice
+// at once
+static void kv_resize(struct work_struct* work) {
+    unsigned int bits;
+    unsigned int new_bits;
+    unsigned int old_bits;
+    int count = atomic_read(&kv_count);
+    kv_table_t* old;
+    kv_table_t* table = rcu_dereference_protected(kv_table, 1);
+
+    old = rcu_dereference_protected(table->old, 1);
+    if (old != NULL) {
+        if (atomic_read(&table->rehashed) < (1 << old->bits)) {
+            return;
+        }
+
+        old_bits = old->bits;
+        RCU_INIT_POINTER(table->old, NULL);
+
+        // Operations may still be looking at the moved buckets
+        synchronize_rcu();
+        vfree(old);
+
+        trace_multilist_kv_resize(old_bits, table->bits, count, true);
+        kv_check_load(table);
+        return;
+    }
+
+    bits = table->bits;
+    if (count > (1U << bits) * KV_MAX_LOAD && bits < KV_MAX_BITS) {
+        new_bits = bits + 1;
+    } else if (count < (1U << bits) / KV_MIN_LOAD && bits > KV_MIN_BITS) {
+        new_bits = max_t(unsigned int, KV_MIN_BITS, order_base_2(count + 1));
+    } else {
+        return;
+    }
+
+    old = table;
+    table = kv_table_alloc(new_bits);
+    if (table == NULL) {
+        return;
+    }
+
+    RCU_INIT_POINTER(table->old, old);
+    rcu_assign_pointer(kv_table, table);
+
+    trace_multilist_kv_resize(bits, new_bits, count, false);
+}
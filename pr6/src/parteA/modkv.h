@@ -0,0 +1,9 @@
+#ifndef _MODKV_H
+#define _MODKV_H
+
+// Key-value store behind /proc/kv, part of the multilist module
+
+int kv_init(void);
+void kv_exit(void);
+
+#endif /* _MODKV_H */
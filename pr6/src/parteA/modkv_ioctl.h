@@ -0,0 +1,44 @@
+#ifndef _MODKV_IOCTL_H
+#define _MODKV_IOCTL_H
+
+// Binary interface of /proc/kv, shared by the module and its users.
+// Every operation is a single ioctl on an open descriptor
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+// Longest key and longest blob value accepted
+#define KV_MAX_KEY 250
+#define KV_MAX_VALUE 4096
+
+// Values are either an int64 or a blob of up to KV_MAX_VALUE bytes
+#define KV_TYPE_INT 1
+#define KV_TYPE_BLOB 2
+
+struct kv_ioc {
+    // User pointer to the key, `key_len` bytes, not NUL terminated
+    __u64 key;
+    // User pointer to the value, an __s64 for KV_TYPE_INT
+    __u64 value;
+    __u32 key_len;
+    // PUT: length of the value
+    // GET: capacity of the buffer, on return the length of the value
+    __u32 value_len;
+    // PUT: type of the value, GET: on return the type of the value
+    __u32 type;
+    __u32 pad;
+};
+
+#define KV_IOC_MAGIC 'k'
+
+// Store the value under the key, replacing any previous one
+#define KV_IOC_PUT _IOW(KV_IOC_MAGIC, 1, struct kv_ioc)
+
+// Copy the value of the key. Fails with ENOENT if there's none, and with
+// ENOSPC if the buffer is too small, `value_len` holds the length needed
+#define KV_IOC_GET _IOWR(KV_IOC_MAGIC, 2, struct kv_ioc)
+
+// Delete the key, fails with ENOENT if there's none
+#define KV_IOC_DEL _IOW(KV_IOC_MAGIC, 3, struct kv_ioc)
+
+#endif /* _MODKV_IOCTL_H */
@@ -1,4 +1,5 @@
 #include "modlist.h"
+#include "multilist_trace.h"
 
 #define READ_BUF_LEN 256
 
@@ -7,14 +8,24 @@ typedef struct list_item_t {
   struct list_head links;
 } list_item_t;
 
+// Per-open state, the generation of the list this reader last saw
+typedef struct list_file_t {
+  int gen;
+} list_file_t;
+
+// Slab shared by the nodes of every list, shows up as `multilist_item`
+// in /proc/slabinfo
+static struct kmem_cache* item_cache;
+
 struct list_head* __list_head_init(void);
 struct list_item_t* __list_item_init(struct list_item_t* data);
 
-void __add_item(struct list_head *, spinlock_t *, int);
+int __add_item(struct callback_data *, int);
 bool __match_item(list_item_t *, int);
-void __remove_item(struct list_head *, spinlock_t *, int);
+int __remove_item(struct callback_data *, int);
 void __free_item(list_item_t *);
 void __cleanup(struct list_head *, spinlock_t *);
+void __list_changed(struct callback_data *);
 
 int __print_list(struct list_head *, spinlock_t *, char *, int);
 
@@ -23,13 +34,49 @@ int __scanadd(const char *, void *);
 int __scanremove(const char *, void *);
 
 static int modlist_open(struct inode* inode, struct file* filp) {
+    list_file_t* file;
     struct callback_data* c_data = (struct callback_data *) PDE_DATA(inode);
     if (atomic_read(&c_data->will_delete) == 1) {
         return -ENOENT;
     }
+
+    file = kmalloc(sizeof(list_file_t), GFP_KERNEL);
+    if (file == NULL) {
+        return -ENOMEM;
+    }
+
+    // Nothing to report until the list changes after the open
+    file->gen = atomic_read(&c_data->gen);
+    filp->private_data = file;
     return 0;
 }
 
+static int modlist_release(struct inode* inode, struct file* filp) {
+    kfree(filp->private_data);
+    return 0;
+}
+
+// Readable once the list moved past the generation this file last read.
+// Writes never block
+static unsigned int modlist_poll(struct file* filp, poll_table* wait) {
+    unsigned int mask = POLLOUT | POLLWRNORM;
+    list_file_t* file = filp->private_data;
+    struct callback_data* c_data;
+
+    c_data = (struct callback_data *) PDE_DATA(filp->f_inode);
+    poll_wait(filp, &c_data->wq, wait);
+
+    if (atomic_read(&c_data->will_delete) == 1) {
+        return POLLHUP;
+    }
+
+    if (atomic_read(&c_data->gen) != file->gen) {
+        mask |= POLLIN | POLLRDNORM;
+    }
+
+    return mask;
+}
+
 static ssize_t modlist_read(struct file* filp, char __user* buf, size_t len,
                             loff_t* off) {
     int size;
@@ -38,6 +85,7 @@ static ssize_t modlist_read(struct file* filp, char __user* buf, size_t len,
 
     struct callback_data* c_data;
     struct list_head* private_list;
+    list_file_t* file = filp->private_data;
 
     if (len == 0) {
         return 0;
@@ -47,13 +95,13 @@ static ssize_t modlist_read(struct file* filp, char __user* buf, size_t len,
         return 0;
     }
 
-    printk(KERN_ALERT "multilist->modlist: calling read\n");
-
     c_data = (struct callback_data *) PDE_DATA(filp->f_inode);
     private_list = c_data->c_list;
+    // Taken before the walk, a change racing with it wakes pollers again
+    file->gen = atomic_read(&c_data->gen);
     size = __print_list(private_list, &c_data->c_lock, own_buffer, READ_BUF_LEN);
+    trace_multilist_read(filp->f_path.dentry->d_name.name, size);
     if (size <= 0) {
-        printk(KERN_INFO "multilist->modlist: Empty list\n");
         return 0;
     }
 
@@ -69,13 +117,13 @@ static ssize_t modlist_read(struct file* filp, char __user* buf, size_t len,
 static ssize_t modlist_write(struct file* filp, const char __user* buf,
                              size_t len, loff_t* off) {
 
+    int ret;
     int data;
+    int removed;
     char own_buffer[READ_BUF_LEN];
 
     struct callback_data* c_data;
-
-    int max_elts;
-    struct list_head* private_list;
+    struct list_head old;
 
     if (copy_from_user(own_buffer, buf, len)) {
         return -EFAULT;
@@ -83,25 +131,36 @@ static ssize_t modlist_write(struct file* filp, const char __user* buf,
 
     own_buffer[len] = '\0';
 
-    printk(KERN_ALERT "multilist->modlist: calling write\n");
-
     c_data = (struct callback_data *) PDE_DATA(filp->f_inode);
 
-    max_elts = c_data->max_elts;
-    private_list = c_data->c_list;
-
     if (__scanadd(own_buffer, &data)) {
-        if (atomic_add_unless(&c_data->elts, 1, max_elts) == 0) {
-            return -ENOSPC;
+        ret = __add_item(c_data, data);
+        if (ret != 0) {
+            return ret;
         }
 
-        __add_item(private_list, &c_data->c_lock, data);
+        __list_changed(c_data);
+        trace_multilist_op(filp->f_path.dentry->d_name.name, "add", data,
+                           atomic_read(&c_data->elts));
     } else if (__scanremove(own_buffer, &data)) {
-        atomic_dec_if_positive(&c_data->elts);
-        __remove_item(private_list, &c_data->c_lock, data);
+        removed = __remove_item(c_data, data);
+        if (removed > 0) {
+            __list_changed(c_data);
+        }
+
+        trace_multilist_op(filp->f_path.dentry->d_name.name, "remove", data,
+                           atomic_read(&c_data->elts));
     } else if (__scancleanup(own_buffer)) {
+        INIT_LIST_HEAD(&old);
+        spin_lock(&c_data->c_lock);
+        list_splice_init(c_data->c_list, &old);
         atomic_set(&c_data->elts, 0);
-        __cleanup(private_list, &c_data->c_lock);
+        spin_unlock(&c_data->c_lock);
+
+        __cleanup(&old, &c_data->c_lock);
+        __list_changed(c_data);
+
+        trace_multilist_op(filp->f_path.dentry->d_name.name, "cleanup", 0, 0);
     } else {
         return -EINVAL;
     }
@@ -111,21 +170,110 @@ static ssize_t modlist_write(struct file* filp, const char __user* buf,
 
 static const struct file_operations proc_entry_fops = {
     .open = modlist_open,
+    .release = modlist_release,
     .read = modlist_read,
-    .write = modlist_write
+    .write = modlist_write,
+    .poll = modlist_poll
 };
 
+int item_cache_create(void) {
+    item_cache = kmem_cache_create("multilist_item", sizeof(list_item_t), 0,
+                                   0, NULL);
+    if (item_cache == NULL) {
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+void item_cache_destroy(void) {
+    kmem_cache_destroy(item_cache);
+}
+
 struct callback_data* call_alloc(void) {
     struct callback_data* data;
 
-    data = vmalloc(sizeof(struct callback_data));
-    memset(data, 0, sizeof(struct callback_data));
+    // kmalloc'ed as it's freed with kfree_rcu
+    data = kzalloc(sizeof(struct callback_data), GFP_KERNEL);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    init_waitqueue_head(&data->wq);
 
     return data;
 }
 
+// Must follow call_hangup, the wait queue stays valid for the RCU grace
+// period epoll and poll() / select() need to unhook from it
 void call_dealloc(struct callback_data* data) {
-    vfree(data);
+    kfree_rcu(data, rcu);
+}
+
+// Wake every poller with POLLHUP | POLLFREE before `data` goes away, epoll
+// drops its entries on the wait queue
+void call_hangup(struct callback_data* data) {
+    wake_up_pollfree(&data->wq);
+}
+
+// Copy the values of the list into `values` if they fit in `max`.
+// Returns how many the list holds, nothing was copied if that's > `max`
+int list_dump(struct callback_data* c_data, s32* values, int max) {
+    int count = 0;
+    list_item_t* item = NULL;
+
+    spin_lock(&c_data->c_lock);
+    list_for_each_entry(item, c_data->c_list, links) {
+        count++;
+    }
+
+    if (count <= max) {
+        count = 0;
+        list_for_each_entry(item, c_data->c_list, links) {
+            values[count++] = item->data;
+        }
+    }
+    spin_unlock(&c_data->c_lock);
+
+    return count;
+}
+
+// Replace the contents of the list with `count` values. The nodes are
+// allocated up front, so the list is swapped in one go under the lock.
+// Adds check and take their room under the same lock, so `elts` matches
+// the new list and none of them can push it past max_elts
+int list_restore(struct callback_data* c_data, const s32* values, int count) {
+    int i;
+    struct list_head batch;
+    struct list_head old;
+    list_item_t* item = NULL;
+
+    INIT_LIST_HEAD(&batch);
+    INIT_LIST_HEAD(&old);
+
+    for (i = 0; i < count; i++) {
+        item = __list_item_init(&(list_item_t) {
+            .data = values[i]
+        });
+
+        if (item == NULL) {
+            __cleanup(&batch, &c_data->c_lock);
+            return -ENOMEM;
+        }
+
+        list_add_tail(&item->links, &batch);
+    }
+
+    spin_lock(&c_data->c_lock);
+    list_splice_init(c_data->c_list, &old);
+    list_splice(&batch, c_data->c_list);
+    atomic_set(&c_data->elts, count);
+    spin_unlock(&c_data->c_lock);
+
+    __cleanup(&old, &c_data->c_lock);
+    __list_changed(c_data);
+
+    return 0;
 }
 
 const struct file_operations* get_fops(void) {
@@ -134,6 +282,9 @@ const struct file_operations* get_fops(void) {
 
 struct list_head* list_alloc(void) {
     struct list_head* private_list = __list_head_init();
+    if (private_list == NULL) {
+        return NULL;
+    }
     INIT_LIST_HEAD(private_list);
     return private_list;
 }
@@ -151,6 +302,9 @@ struct list_head* __list_head_init(void) {
     struct list_head* head;
 
     head = vmalloc((sizeof(struct list_head)));
+    if (head == NULL) {
+        return NULL;
+    }
     memset(head, 0, sizeof(struct list_head));
 
     return head;
@@ -158,8 +312,11 @@ struct list_head* __list_head_init(void) {
 
 struct list_item_t* __list_item_init(list_item_t* data) {
   list_item_t* item;
-  item = vmalloc((sizeof(list_item_t)));
-  memset(item, 0, sizeof(list_item_t));
+  item = kmem_cache_alloc(item_cache, GFP_KERNEL);
+  if (item == NULL) {
+    return NULL;
+  }
+
   memcpy(item, data, sizeof(list_item_t));
   return item;
 }
@@ -182,7 +339,6 @@ int __print_list(struct list_head* list, spinlock_t* lock, char* buf, int len) {
         // If we'd go over the size of the buffer,
         // discard next entries and return
         if ((buf_len + sz) > len) {
-            printk(KERN_INFO "__print_list read over %d (max), returing %d\n", len, buf_len);
             break;
         }
 
@@ -215,15 +371,29 @@ int __scanremove(const char* buffer, void* container) {
     return sscanf(buffer, format, container);
 }
 
-void __add_item(struct list_head* list, spinlock_t* lock, int data) {
+// The room left is checked under the lock, a restore or cleanup swapping
+// the list can't slip between the check and the link
+int __add_item(struct callback_data* c_data, int data) {
     list_item_t* new_item;
     new_item = __list_item_init(&(list_item_t) {
         .data = data
     });
 
-    spin_lock(lock);
-    list_add_tail(&new_item->links, list);
-    spin_unlock(lock);
+    if (new_item == NULL) {
+        return -ENOMEM;
+    }
+
+    spin_lock(&c_data->c_lock);
+    if (atomic_read(&c_data->elts) >= c_data->max_elts) {
+        spin_unlock(&c_data->c_lock);
+        __free_item(new_item);
+        return -ENOSPC;
+    }
+
+    list_add_tail(&new_item->links, c_data->c_list);
+    atomic_inc(&c_data->elts);
+    spin_unlock(&c_data->c_lock);
+    return 0;
 }
 
 void __cleanup(struct list_head* list, spinlock_t* lock) {
@@ -235,25 +405,31 @@ void __cleanup(struct list_head* list, spinlock_t* lock) {
     list_for_each_safe(cur_node, aux_storage, list) {
       item = list_entry(cur_node, list_item_t, links);
       list_del(cur_node);
-      vfree(item);
+      __free_item(item);
     }
     spin_unlock(lock);
 }
 
-void __remove_item(struct list_head* list, spinlock_t* lock, int data) {
+// Returns the number of nodes removed
+int __remove_item(struct callback_data* c_data, int data) {
+    int removed = 0;
     struct list_head* cur_node = NULL;
     struct list_head* aux_storage = NULL;
     list_item_t* item = NULL;
 
-    spin_lock(lock);
-    list_for_each_safe(cur_node, aux_storage, list) {
+    spin_lock(&c_data->c_lock);
+    list_for_each_safe(cur_node, aux_storage, c_data->c_list) {
         item = list_entry(cur_node, list_item_t, links);
         if (__match_item(item, data)) {
             list_del(cur_node);
             __free_item(item);
+            removed++;
         }
     }
-    spin_unlock(lock);
+    atomic_sub(removed, &c_data->elts);
+    spin_unlock(&c_data->c_lock);
+
+    return removed;
 }
 
 bool __match_item(list_item_t* item, int data) {
@@ -261,7 +437,12 @@ bool __match_item(list_item_t* item, int data) {
 }
 
 void __free_item(list_item_t* item) {
-  vfree(item);
+  kmem_cache_free(item_cache, item);
+}
+
+void __list_changed(struct callback_data* c_data) {
+    atomic_inc(&c_data->gen);
+    wake_up_interruptible_poll(&c_data->wq, POLLIN | POLLRDNORM);
 }
 
 MODULE_LICENSE("GPL");
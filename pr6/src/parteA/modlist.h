@@ -5,15 +5,20 @@
 #include <linux/kernel.h>
 #include <linux/atomic.h>
 #include <linux/module.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
 #include <linux/spinlock.h>
 #include <linux/proc_fs.h>
+#include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/wait.h>
 
 struct callback_data {
     // Deny clients if we're going to delete entry
     atomic_t will_delete;
-    // Current number of elements
+    // Current number of elements, only changed under `c_lock` along with
+    // the list so it never drifts from its length
     atomic_t elts;
     // Max number of elements allowed
     int max_elts;
@@ -21,13 +26,26 @@ struct callback_data {
     spinlock_t c_lock;
     // Private list
     struct list_head* c_list;
+    // Bumped on every add, remove and cleanup
+    atomic_t gen;
+    // Pollers waiting for `gen` to move
+    wait_queue_head_t wq;
+    // Freed after a grace period, pollers may still be unhooking from `wq`
+    struct rcu_head rcu;
 };
 
+int item_cache_create(void);
+void item_cache_destroy(void);
+
 struct list_head* list_alloc(void);
 void list_dealloc(struct list_head *, spinlock_t *);
 
 struct callback_data* call_alloc(void);
 void call_dealloc(struct callback_data *);
+void call_hangup(struct callback_data *);
+
+int list_dump(struct callback_data *, s32 *, int);
+int list_restore(struct callback_data *, const s32 *, int);
 
 const struct file_operations* get_fops(void);
 
@@ -4,14 +4,44 @@
 #include <linux/vmalloc.h>
 #include <linux/proc_fs.h>
 #include <linux/atomic.h>
-#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/rhashtable.h>
 #include <linux/moduleparam.h>
 #include <asm-generic/uaccess.h>
 
 #include "modlist.h"
+#include "modkv.h"
+#include "modsnapshot.h"
 
+#define CREATE_TRACE_POINTS
+#include "multilist_trace.h"
+
+// Longest list name plus the terminator, names are stored inline
+// and zero padded, as the registry hashes all LIST_LEN bytes
 #define LIST_LEN 25
-#define CONFIG_BUFFER 50
+
+// Control commands take any number of names and ranges of numeric
+// names, `delete` also takes `*` for every list:
+//
+//   create a b c
+//   create 0..1023
+//   delete *
+//
+// A command must fit in a single write of up to CONFIG_BUFFER bytes
+#define CONFIG_BUFFER PAGE_SIZE
+
+// `dump` serializes every list into /proc/list/snapshot, `restore` loads
+// the image last written there, creating the lists it doesn't find:
+//
+//   echo dump > /proc/list/control
+//   cat /proc/list/snapshot > image
+//   ...
+//   cat image > /proc/list/snapshot
+//   echo restore > /proc/list/control
+//
+// Writes to the snapshot entry starting at offset 0 begin a new image.
+// Largest image accepted
+#define SNAPSHOT_MAX (256 << 20)
 
 static atomic_t current_entries = ATOMIC_INIT(0);
 
@@ -26,83 +56,183 @@ MODULE_PARM_DESC(max_size, "Maximum number of elements inside the dynamic lists"
 
 struct list_head* main_list;
 typedef struct list_item_t {
-    char* list_name;
+    char list_name[LIST_LEN];
     struct callback_data* proc_data;
     struct proc_dir_entry* proc_entry;
 
     struct list_head links;
+    struct rhash_head node;
+    struct rcu_head rcu;
 } list_item_t;
 
-DEFINE_SPINLOCK(list_lock);
+// Cursor over the names of a control command, ranges are expanded
+// one name at a time. Outside of a range `next` > `last`
+typedef struct name_iter_t {
+    const char* pos;
+    long next;
+    long last;
+} name_iter_t;
+
+// Registry of the lists, indexed by name. Lookups only take the RCU
+// read lock, create / delete are serialized by registry_lock, which
+// also protects main_list
+static struct rhashtable registry;
+static DEFINE_MUTEX(registry_lock);
+
+// Image behind /proc/list/snapshot, `snapshot_cap` bytes are allocated
+static DEFINE_MUTEX(snapshot_lock);
+static char* snapshot;
+static size_t snapshot_len;
+static size_t snapshot_cap;
+
+static const struct rhashtable_params registry_params = {
+    .head_offset = offsetof(list_item_t, node),
+    .key_offset = offsetof(list_item_t, list_name),
+    .key_len = LIST_LEN,
+    .automatic_shrinking = true,
+};
 
 struct list_head* proc_list_init(void);
 
-int add_proc_entry(struct list_head *, char *);
-void remove_matching_proc_entry(struct list_head *, char *);
+int create_proc_entries(struct list_head *, const char *);
+int delete_proc_entries(struct list_head *, const char *);
 
-bool proc_match_item(list_item_t *, char *);
+int dump_proc_entries(struct list_head *);
+int restore_proc_entries(struct list_head *);
+int __check_snapshot(struct list_head *, int *);
+int __snapshot_reserve(size_t);
+void __snapshot_free(void);
+
+void name_iter_init(name_iter_t *, const char *);
+int next_name(name_iter_t *, char *);
+int __range_next(name_iter_t *, char *);
+int __reserve_entries(int);
+
+int __add_proc_entry(struct list_head *, char *, int);
+void __remove_proc_entry(list_item_t *);
+
+void __registry_key(char *, const char *);
 int contains(struct list_head *, char *);
+int reserved_name(const char *);
 
 void proc_cleanup(struct list_head *);
 void proc_free_item(list_item_t *);
 
 static ssize_t config_proc_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t snapshot_proc_read(struct file *, char *, size_t, loff_t *);
+static ssize_t snapshot_proc_write(struct file *, const char *, size_t, loff_t *);
 
 static struct proc_dir_entry* proc_dir = NULL;
 static struct proc_dir_entry* config_entry;
+static struct proc_dir_entry* snapshot_entry;
 
 static const struct file_operations config_entry_fops = {
     .write = config_proc_write
 };
 
+static const struct file_operations snapshot_entry_fops = {
+    .read = snapshot_proc_read,
+    .write = snapshot_proc_write
+};
+
 static ssize_t config_proc_write(struct file *filp, const char __user *buf,
                                  size_t len, loff_t *off) {
 
-    char list_name[LIST_LEN];
-    char own_buffer[CONFIG_BUFFER];
+    int ret;
+    char* own_buffer;
 
     if ((*off) > 0) {
         return 0;
     }
 
-    printk(KERN_INFO "modmain: Writing config\n");
+    if (len >= CONFIG_BUFFER) {
+        return -ENOSPC;
+    }
+
+    own_buffer = kmalloc(len + 1, GFP_KERNEL);
+    if (own_buffer == NULL) {
+        return -ENOMEM;
+    }
 
     if (copy_from_user(own_buffer, buf, len)) {
+        kfree(own_buffer);
         return -EFAULT;
     }
 
     own_buffer[len] = '\0';
     *off += len;
 
-    if (sscanf(own_buffer, "create %s", list_name)) {
-        if (contains(main_list, list_name)) {
-            printk(KERN_INFO "modmain: Entry %s already exists\n", list_name);
-            return -EINVAL;
-        }
+    if (strncmp(own_buffer, "create ", 7) == 0) {
+        ret = create_proc_entries(main_list, own_buffer + 7);
+    } else if (strncmp(own_buffer, "delete ", 7) == 0) {
+        ret = delete_proc_entries(main_list, own_buffer + 7);
+    } else if (sysfs_streq(own_buffer, "dump")) {
+        ret = dump_proc_entries(main_list);
+    } else if (sysfs_streq(own_buffer, "restore")) {
+        ret = restore_proc_entries(main_list);
+    } else {
+        ret = -EINVAL;
+    }
 
-        if (add_proc_entry(main_list, list_name) != 0) {
-            return -ENOSPC;
-        }
+    kfree(own_buffer);
+    return (ret != 0) ? ret : len;
+}
+
+static ssize_t snapshot_proc_read(struct file *filp, char __user *buf,
+                                  size_t len, loff_t *off) {
+    ssize_t ret;
+
+    mutex_lock(&snapshot_lock);
+    ret = simple_read_from_buffer(buf, len, off, snapshot, snapshot_len);
+    mutex_unlock(&snapshot_lock);
 
-        return len;
+    return ret;
+}
+
+static ssize_t snapshot_proc_write(struct file *filp, const char __user *buf,
+                                   size_t len, loff_t *off) {
+    int ret;
+
+    if (*off < 0 || *off + len > SNAPSHOT_MAX) {
+        return -EFBIG;
+    }
+
+    mutex_lock(&snapshot_lock);
+    if (*off == 0) {
+        snapshot_len = 0;
     }
-    
-    if (sscanf(own_buffer, "delete %s", list_name)) {
-        if (!contains(main_list, list_name)) {
-            printk(KERN_INFO "modmain: Entry %s doesn't exist\n", list_name);
-            return -EINVAL;
-        }
 
-        remove_matching_proc_entry(main_list, list_name);
-        return len;
+    // No holes, the image is written front to back
+    ret = (*off > snapshot_len) ? -EINVAL : __snapshot_reserve(*off + len);
+    if (ret == 0 && copy_from_user(snapshot + *off, buf, len)) {
+        ret = -EFAULT;
     }
 
-    return -EINVAL;
+    if (ret == 0) {
+        *off += len;
+        snapshot_len = max_t(size_t, snapshot_len, *off);
+    }
+    mutex_unlock(&snapshot_lock);
+
+    return (ret != 0) ? ret : len;
 }
 
 int init_modmain(void) {
+    if (item_cache_create() != 0) {
+        printk(KERN_INFO "modmain: Can't create item cache\n");
+        return -ENOMEM;
+    }
+
+    if (rhashtable_init(&registry, &registry_params) != 0) {
+        item_cache_destroy();
+        printk(KERN_INFO "modmain: Can't create list registry\n");
+        return -ENOMEM;
+    }
+
     proc_dir = proc_mkdir("list", NULL);
     if (!proc_dir) {
+        rhashtable_destroy(&registry);
+        item_cache_destroy();
         printk(KERN_INFO "modmain: Can't create /proc directory\n");
         return -ENOMEM;
     }
@@ -110,13 +240,34 @@ int init_modmain(void) {
     config_entry = proc_create("control", 0666, proc_dir, &config_entry_fops);
     if (config_entry == NULL) {
         remove_proc_entry("list", NULL);
+        rhashtable_destroy(&registry);
+        item_cache_destroy();
+        return -ENOMEM;
+    }
+
+    snapshot_entry = proc_create("snapshot", 0666, proc_dir, &snapshot_entry_fops);
+    if (snapshot_entry == NULL) {
+        remove_proc_entry("control", proc_dir);
+        remove_proc_entry("list", NULL);
+        rhashtable_destroy(&registry);
+        item_cache_destroy();
+        return -ENOMEM;
+    }
+
+    if (kv_init() != 0) {
+        remove_proc_entry("snapshot", proc_dir);
+        remove_proc_entry("control", proc_dir);
+        remove_proc_entry("list", NULL);
+        rhashtable_destroy(&registry);
+        item_cache_destroy();
+        printk(KERN_INFO "modmain: Can't create /proc/kv\n");
         return -ENOMEM;
     }
 
     main_list = proc_list_init();
     INIT_LIST_HEAD(main_list);
 
-    add_proc_entry(main_list, "default");
+    create_proc_entries(main_list, "default");
 
     printk(KERN_INFO "modmain: module loaded\n");
 
@@ -124,15 +275,387 @@ int init_modmain(void) {
 }
 
 void exit_modmain(void) {
-    proc_cleanup(main_list);
-    vfree(main_list);
+    kv_exit();
+    // Waits for in-flight commands, no list can be created past this
+    remove_proc_entry("snapshot", proc_dir);
     remove_proc_entry("control", proc_dir);
+    proc_cleanup(main_list);
+    // Lists live in the directory, it's only empty now
     remove_proc_entry("list", NULL);
+    rhashtable_destroy(&registry);
+    vfree(main_list);
+    __snapshot_free();
+    item_cache_destroy();
     printk(KERN_INFO "modmain: module unloaded\n");
 }
 
+// Create every list named in `args`, either all of them or none.
+// Capacity is reserved and registry_lock taken once for the whole batch
+int create_proc_entries(struct list_head* list, const char* args) {
+    int ret;
+    int count = 0;
+    name_iter_t it;
+    char name[LIST_LEN];
+
+    struct list_head batch;
+    struct list_head* cur_node = NULL;
+    struct list_head* aux_storage = NULL;
+    list_item_t* item = NULL;
+
+    // Validate the names first, with lock-free lookups
+    name_iter_init(&it, args);
+    while ((ret = next_name(&it, name)) > 0) {
+        if (contains(list, name) || reserved_name(name)) {
+            printk(KERN_INFO "modmain: Entry %s already exists\n", name);
+            return -EINVAL;
+        }
+        count++;
+    }
+
+    if (ret < 0 || count == 0) {
+        return (ret < 0) ? ret : -EINVAL;
+    }
+
+    if (__reserve_entries(count) != 0) {
+        return -ENOSPC;
+    }
+
+    INIT_LIST_HEAD(&batch);
+
+    mutex_lock(&registry_lock);
+    name_iter_init(&it, args);
+    while (next_name(&it, name) > 0) {
+        ret = __add_proc_entry(&batch, name, max_size);
+        if (ret != 0) {
+            break;
+        }
+    }
+
+    if (ret == 0) {
+        list_for_each(cur_node, &batch) {
+            item = list_entry(cur_node, list_item_t, links);
+            trace_multilist_control("create", item->list_name);
+        }
+        list_splice_tail(&batch, list);
+    } else {
+        // Created meanwhile or repeated in the batch, undo the batch
+        list_for_each_safe(cur_node, aux_storage, &batch) {
+            item = list_entry(cur_node, list_item_t, links);
+            rhashtable_remove_fast(&registry, &item->node, registry_params);
+            list_del(cur_node);
+            proc_free_item(item);
+        }
+    }
+    mutex_unlock(&registry_lock);
+
+    if (ret != 0) {
+        atomic_sub(count, &current_entries);
+    }
+
+    if (ret == -EEXIST) {
+        printk(KERN_INFO "modmain: Entry %s already exists\n", name);
+        return -EINVAL;
+    }
+
+    return ret;
+}
+
+// Delete every list named in `args` that exists, -EINVAL if some didn't
+int delete_proc_entries(struct list_head* list, const char* args) {
+    int ret;
+    int missing = 0;
+    int deleted = 0;
+    name_iter_t it;
+    char key[LIST_LEN];
+    char name[LIST_LEN];
+    list_item_t* item = NULL;
+
+    args = skip_spaces(args);
+    if (args[0] == '*' && *skip_spaces(args + 1) == '\0') {
+        proc_cleanup(list);
+        return 0;
+    }
+
+    // Don't delete anything if the command is malformed
+    name_iter_init(&it, args);
+    do {
+        ret = next_name(&it, name);
+    } while (ret > 0);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    mutex_lock(&registry_lock);
+    name_iter_init(&it, args);
+    while (next_name(&it, name) > 0) {
+        __registry_key(key, name);
+        item = rhashtable_lookup_fast(&registry, key, registry_params);
+        if (item == NULL) {
+            printk(KERN_INFO "modmain: Entry %s doesn't exist\n", name);
+            missing++;
+            continue;
+        }
+
+        __remove_proc_entry(item);
+        deleted++;
+    }
+    mutex_unlock(&registry_lock);
+
+    atomic_sub(deleted, &current_entries);
+
+    return (missing > 0 || deleted == 0) ? -EINVAL : 0;
+}
+
+// Serialize every list into the snapshot image. Lists can't come and go
+// meanwhile, each of them is copied under its own lock
+int dump_proc_entries(struct list_head* list) {
+    int ret = 0;
+    int lists = 0;
+    int elts;
+    int fits;
+    size_t len = sizeof(struct snapshot_header);
+    struct snapshot_header* header;
+    struct snapshot_list* record;
+    list_item_t* item = NULL;
+
+    BUILD_BUG_ON(LIST_LEN > SNAPSHOT_NAME_LEN);
+
+    mutex_lock(&snapshot_lock);
+    mutex_lock(&registry_lock);
+
+    snapshot_len = 0;
+    ret = __snapshot_reserve(len);
+    if (ret != 0) {
+        goto out;
+    }
+
+    // The image grows as the lists are copied, each record sized by the
+    // values its list holds. Adds racing with a copy make it try again
+    list_for_each_entry(item, list, links) {
+        elts = atomic_read(&item->proc_data->elts);
+        do {
+            fits = elts;
+            if (len + sizeof(struct snapshot_list) + (size_t) fits * sizeof(s32) >
+                SNAPSHOT_MAX) {
+                ret = -EFBIG;
+                goto out;
+            }
+
+            // Bytes copied so far are kept by __snapshot_reserve
+            snapshot_len = len;
+            ret = __snapshot_reserve(len + sizeof(struct snapshot_list) +
+                                     fits * sizeof(s32));
+            if (ret != 0) {
+                goto out;
+            }
+
+            record = (struct snapshot_list *) (snapshot + len);
+            elts = list_dump(item->proc_data, (s32 *) (record + 1), fits);
+        } while (elts > fits);
+
+        memset(record->name, 0, SNAPSHOT_NAME_LEN);
+        strcpy(record->name, item->list_name);
+        record->max_elts = item->proc_data->max_elts;
+        record->elts = elts;
+
+        len += sizeof(struct snapshot_list) + elts * sizeof(s32);
+        lists++;
+    }
+
+    header = (struct snapshot_header *) snapshot;
+    header->magic = SNAPSHOT_MAGIC;
+    header->lists = lists;
+    snapshot_len = len;
+
+    trace_multilist_snapshot("dump", lists, len);
+
+out:
+    // Don't leave half an image behind
+    if (ret != 0) {
+        snapshot_len = 0;
+    }
+
+    mutex_unlock(&registry_lock);
+    mutex_unlock(&snapshot_lock);
+    return ret;
+}
+
+// Load the snapshot image in a single pass. Lists in the image take its
+// max_elts, capped at max_size, and contents, the ones missing are created
+// first. The image is checked beforehand, so only running out of memory
+// stops it halfway
+int restore_proc_entries(struct list_head* list) {
+    int ret;
+    int fresh;
+    int created = 0;
+    size_t pos = sizeof(struct snapshot_header);
+    struct snapshot_header* header;
+    struct snapshot_list* record;
+    char key[LIST_LEN];
+    list_item_t* item = NULL;
+    int i;
+
+    mutex_lock(&snapshot_lock);
+    mutex_lock(&registry_lock);
+
+    ret = __check_snapshot(list, &fresh);
+    if (ret != 0) {
+        goto out;
+    }
+
+    if (__reserve_entries(fresh) != 0) {
+        ret = -ENOSPC;
+        goto out;
+    }
+
+    header = (struct snapshot_header *) snapshot;
+    for (i = 0; i < header->lists && ret == 0; i++) {
+        record = (struct snapshot_list *) (snapshot + pos);
+        pos += sizeof(struct snapshot_list) + record->elts * sizeof(s32);
+
+        __registry_key(key, record->name);
+        item = rhashtable_lookup_fast(&registry, key, registry_params);
+        if (item == NULL) {
+            ret = __add_proc_entry(list, record->name,
+                                   min_t(u32, record->max_elts, max_size));
+            if (ret != 0) {
+                break;
+            }
+
+            item = list_last_entry(list, list_item_t, links);
+            trace_multilist_control("create", item->list_name);
+            created++;
+        }
+
+        item->proc_data->max_elts = min_t(u32, record->max_elts, max_size);
+        ret = list_restore(item->proc_data, (s32 *) (record + 1), record->elts);
+    }
+
+    // Lists left uncreated by a failure halfway
+    atomic_sub(fresh - created, &current_entries);
+
+    if (ret == 0) {
+        trace_multilist_snapshot("restore", header->lists, snapshot_len);
+        // The image is consumed, don't keep it around
+        __snapshot_free();
+    }
+
+out:
+    mutex_unlock(&registry_lock);
+    mutex_unlock(&snapshot_lock);
+    return ret;
+}
+
 // Util
 
+// Check that the snapshot image is well formed, storing in `fresh` the
+// number of lists it would create, each name repeated in the image once.
+// Returns -ENOSPC if they don't fit. Caller must hold both locks
+int __check_snapshot(struct list_head* list, int* fresh) {
+    int i;
+    int j;
+    int ret = 0;
+    int room = (int) max_entries - atomic_read(&current_entries);
+    size_t pos = sizeof(struct snapshot_header);
+    struct snapshot_header* header = (struct snapshot_header *) snapshot;
+    struct snapshot_list* record;
+    // Names of the lists to create, only `room` of them can be
+    const char** names;
+
+    *fresh = 0;
+
+    if (snapshot_len < sizeof(struct snapshot_header) ||
+        header->magic != SNAPSHOT_MAGIC) {
+        return -EINVAL;
+    }
+
+    names = kmalloc_array(max(room, 1), sizeof(char *), GFP_KERNEL);
+    if (names == NULL) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < header->lists; i++) {
+        if (snapshot_len - pos < sizeof(struct snapshot_list)) {
+            ret = -EINVAL;
+            goto out;
+        }
+
+        record = (struct snapshot_list *) (snapshot + pos);
+        pos += sizeof(struct snapshot_list);
+
+        if (strnlen(record->name, LIST_LEN) == LIST_LEN ||
+            record->name[0] == '\0' || reserved_name(record->name) ||
+            record->elts > min_t(u32, record->max_elts, max_size) ||
+            (snapshot_len - pos) / sizeof(s32) < record->elts) {
+            ret = -EINVAL;
+            goto out;
+        }
+
+        pos += record->elts * sizeof(s32);
+
+        if (contains(list, record->name)) {
+            continue;
+        }
+
+        for (j = 0; j < *fresh; j++) {
+            if (strncmp(names[j], record->name, LIST_LEN) == 0) {
+                break;
+            }
+        }
+
+        if (j == *fresh) {
+            if (*fresh >= room) {
+                ret = -ENOSPC;
+                goto out;
+            }
+            names[(*fresh)++] = record->name;
+        }
+    }
+
+    ret = (pos == snapshot_len) ? 0 : -EINVAL;
+
+out:
+    kfree(names);
+    return ret;
+}
+
+// Make room for a `len` bytes image, keeping the bytes already written.
+// Caller must hold snapshot_lock
+int __snapshot_reserve(size_t len) {
+    char* grown;
+    size_t cap = max_t(size_t, snapshot_cap, PAGE_SIZE);
+
+    if (len <= snapshot_cap) {
+        return 0;
+    }
+
+    while (cap < len) {
+        cap *= 2;
+    }
+
+    grown = vmalloc(cap);
+    if (grown == NULL) {
+        return -ENOMEM;
+    }
+
+    if (snapshot_len > 0) {
+        memcpy(grown, snapshot, snapshot_len);
+    }
+
+    vfree(snapshot);
+    snapshot = grown;
+    snapshot_cap = cap;
+    return 0;
+}
+
+void __snapshot_free(void) {
+    vfree(snapshot);
+    snapshot = NULL;
+    snapshot_len = 0;
+    snapshot_cap = 0;
+}
+
 struct list_head* proc_list_init(void) {
     struct list_head* head;
 
@@ -143,149 +666,214 @@ struct list_head* proc_list_init(void) {
 }
 
 struct list_item_t* __litem_alloc(void) {
-    list_item_t* item;
-    item = vmalloc((sizeof(list_item_t)));
-    memset(item, 0, sizeof(list_item_t));
-    return item;
+    // kmalloc'ed as it's freed with kfree_rcu
+    return kzalloc(sizeof(list_item_t), GFP_KERNEL);
 }
 
-char* __lname_alloc(char* list_name) {
-    char* new_name;
-    int list_name_size = sizeof(char) * strlen(list_name) + 1;
-    new_name = vmalloc(list_name_size);
-    memset(new_name, 0, list_name_size);
-    memcpy(new_name, list_name, list_name_size);
-    return new_name;
+// Registry keys are the LIST_LEN bytes of the name, zero padded
+void __registry_key(char* key, const char* list_name) {
+    strncpy(key, list_name, LIST_LEN);
+    key[LIST_LEN - 1] = '\0';
+}
+
+void name_iter_init(name_iter_t* it, const char* args) {
+    it->pos = args;
+    it->next = 1;
+    it->last = 0;
+}
+
+// Name the next number of the range. The last one ends the range without
+// stepping past it, which would overflow for a range ending at LONG_MAX
+int __range_next(name_iter_t* it, char* name) {
+    snprintf(name, LIST_LEN, "%ld", it->next);
+
+    if (it->next == it->last) {
+        it->next = 1;
+        it->last = 0;
+    } else {
+        it->next++;
+    }
+
+    return 1;
+}
+
+// Store the next name of the command in `name`. Returns 1 if there was
+// one, 0 at the end and a negative error for a malformed name or range
+int next_name(name_iter_t* it, char* name) {
+    size_t len;
+    char* dots;
+    const char* token;
+
+    if (it->next <= it->last) {
+        return __range_next(it, name);
+    }
+
+    token = skip_spaces(it->pos);
+    len = strcspn(token, " \t\n");
+    if (len == 0) {
+        return 0;
+    }
+
+    it->pos = token + len;
+    if (len >= LIST_LEN) {
+        return -EINVAL;
+    }
+
+    memcpy(name, token, len);
+    name[len] = '\0';
+
+    dots = strstr(name, "..");
+    if (dots == NULL) {
+        return 1;
+    }
+
+    *dots = '\0';
+    if (kstrtol(name, 10, &it->next) || kstrtol(dots + 2, 10, &it->last) ||
+        it->next > it->last) {
+        return -EINVAL;
+    }
+
+    // Would never fit, don't spend time counting it. The bounds are
+    // ordered, so the unsigned difference can't wrap, while the signed one
+    // overflows for ranges as wide as LONG_MIN..LONG_MAX
+    if ((unsigned long) it->last - (unsigned long) it->next >= max_entries) {
+        return -ENOSPC;
+    }
+
+    return __range_next(it, name);
 }
 
-void __add_proc_entry(struct list_head* list, list_item_t* item) {
-    spin_lock(&list_lock);
-    list_add_tail(&item->links, list);
-    spin_unlock(&list_lock);
+// Claim room for `count` lists at once
+int __reserve_entries(int count) {
+    int cur;
+
+    do {
+        cur = atomic_read(&current_entries);
+        if (cur + count > max_entries) {
+            return -ENOSPC;
+        }
+    } while (atomic_cmpxchg(&current_entries, cur, cur + count) != cur);
+
+    return 0;
 }
 
-int add_proc_entry(struct list_head* list, char* stack_list_name) {
+// Caller must hold registry_lock and have reserved the entry.
+// Returns -EEXIST if the name is taken
+int __add_proc_entry(struct list_head* list, char* stack_list_name,
+                     int max_elts) {
+    int ret;
     list_item_t* obj;
     struct callback_data* proc_data;
 
-    char* d_list_name;
     struct list_head* d_list;
     struct proc_dir_entry* d_entry;
 
-    // Respect global max
-    if (atomic_add_unless(&current_entries, 1, max_entries) == 0) {
-        return -1;
+    obj = __litem_alloc();
+    if (obj == NULL) {
+        return -ENOMEM;
     }
 
-    obj = __litem_alloc();
+    __registry_key(obj->list_name, stack_list_name);
+
+    ret = rhashtable_lookup_insert_fast(&registry, &obj->node, registry_params);
+    if (ret != 0) {
+        kfree(obj);
+        return ret;
+    }
 
     d_list = list_alloc();
+    if (d_list == NULL) {
+        goto err_list;
+    }
+
     proc_data = call_alloc();
-    d_list_name = __lname_alloc(stack_list_name);
+    if (proc_data == NULL) {
+        goto err_data;
+    }
 
     proc_data->c_list = d_list;
     atomic_set(&proc_data->elts, 0);
     atomic_set(&proc_data->will_delete, 0);
-    proc_data->max_elts = max_size;
+    proc_data->max_elts = max_elts;
     spin_lock_init(&proc_data->c_lock);
 
-    d_entry = proc_create_data(stack_list_name, 0666, proc_dir, get_fops(), proc_data);
+    d_entry = proc_create_data(obj->list_name, 0666, proc_dir, get_fops(), proc_data);
+    if (d_entry == NULL) {
+        goto err_entry;
+    }
 
     obj->proc_data = proc_data;
-    obj->list_name = d_list_name;
     obj->proc_entry = d_entry;
 
-    __add_proc_entry(list, obj);
+    list_add_tail(&obj->links, list);
 
     return 0;
-}
-
-int contains(struct list_head* list, char* list_name) {
-    int found = 0;
-    struct list_head* cur_node = NULL;
-    list_item_t* item = NULL;
-
-    spin_lock(&list_lock);
-    list_for_each(cur_node, list) {
-        item = list_entry(cur_node, list_item_t, links);
-        if (proc_match_item(item, list_name)) {
-            found = 1;
-            break;
-        }
-    }
-    spin_unlock(&list_lock);
 
-    return found;
+err_entry:
+    call_dealloc(proc_data);
+err_data:
+    vfree(d_list);
+err_list:
+    rhashtable_remove_fast(&registry, &obj->node, registry_params);
+    // Lock-free lookups may already have found it
+    kfree_rcu(obj, rcu);
+    return -ENOMEM;
 }
 
-void proc_cleanup(struct list_head* list) {
-    struct list_head tmp;
-    struct list_head* cur_node = NULL;
-    struct list_head* aux_storage = NULL;
-    list_item_t* item = NULL;
-
-    INIT_LIST_HEAD(&tmp);
+// Caller must hold registry_lock, so the /proc entry is gone
+// before the name can be created again
+void __remove_proc_entry(list_item_t* item) {
+    rhashtable_remove_fast(&registry, &item->node, registry_params);
+    list_del(&item->links);
+    trace_multilist_control("delete", item->list_name);
+    proc_free_item(item);
+}
 
-    spin_lock(&list_lock);
-    list_for_each_safe(cur_node, aux_storage, list) {
-        item = list_entry(cur_node, list_item_t, links);
-        list_move(cur_node, &tmp);
-    }
-    spin_unlock(&list_lock);
+int contains(struct list_head* list, char* list_name) {
+    char key[LIST_LEN];
+    __registry_key(key, list_name);
+    return rhashtable_lookup_fast(&registry, key, registry_params) != NULL;
+}
 
-    list_for_each_safe(cur_node, aux_storage, &tmp) {
-        item = list_entry(cur_node, list_item_t, links);
-        list_del(cur_node);
-        proc_free_item(item);
-    }
+// Names of the entries of the module itself in /proc/list
+int reserved_name(const char* list_name) {
+    return strcmp(list_name, "control") == 0 ||
+           strcmp(list_name, "snapshot") == 0;
 }
 
-void remove_matching_proc_entry(struct list_head* list, char* data) {
-    struct list_head tmp;
+// Delete every list
+void proc_cleanup(struct list_head* list) {
+    int deleted = 0;
     struct list_head* cur_node = NULL;
     struct list_head* aux_storage = NULL;
     list_item_t* item = NULL;
 
-    INIT_LIST_HEAD(&tmp);
-
-    spin_lock(&list_lock);
+    mutex_lock(&registry_lock);
     list_for_each_safe(cur_node, aux_storage, list) {
         item = list_entry(cur_node, list_item_t, links);
-        if (proc_match_item(item, data)) {
-            list_move(cur_node, &tmp);
-        }
-    }
-    spin_unlock(&list_lock);
-
-    list_for_each_safe(cur_node, aux_storage, &tmp) {
-        item = list_entry(cur_node, list_item_t, links);
-        list_del(cur_node);
-        atomic_dec_if_positive(&current_entries);
-        proc_free_item(item);
+        __remove_proc_entry(item);
+        deleted++;
     }
-}
+    mutex_unlock(&registry_lock);
 
-bool proc_match_item(list_item_t* item, char* name) {
-    if (strlen(item->list_name) != strlen(name)) {
-        return 0;
-    }
-
-    return (0 == strncmp(item->list_name, name, strlen(name)));
+    atomic_sub(deleted, &current_entries);
 }
 
 void __free_item_contents(list_item_t* node) {
     // Tell clients to not open files anymore
     atomic_set(&node->proc_data->will_delete, 1);
+    // Waits for in-flight read / write / poll calls on the entry
+    remove_proc_entry(node->list_name, proc_dir);
+    call_hangup(node->proc_data);
     // Free the list (using private lock)
     list_dealloc(node->proc_data->c_list, &(node->proc_data->c_lock));
     call_dealloc(node->proc_data);
-    remove_proc_entry(node->list_name, proc_dir);
-    vfree(node->list_name);
 }
 
+// Lock-free lookups may still be comparing against the name
 void proc_free_item(list_item_t* item) {
     __free_item_contents(item);
-    vfree(item);
+    kfree_rcu(item, rcu);
 }
 
 MODULE_LICENSE("GPL");
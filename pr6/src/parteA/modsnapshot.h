@@ -0,0 +1,30 @@
+#ifndef _MODSNAPSHOT_H
+#define _MODSNAPSHOT_H
+
+// Image of every list, as read from and written to /proc/list/snapshot.
+// It's a snapshot_header followed by `lists` records, each of them a
+// snapshot_list followed by its `elts` values as __s32, in list order.
+// Integers are in host byte order, images are meant to be restored on
+// the machine that dumped them
+
+#include <linux/types.h>
+
+// "MLS1"
+#define SNAPSHOT_MAGIC 0x4d4c5331
+
+// Room for a list name and its terminator, padded to keep values aligned
+#define SNAPSHOT_NAME_LEN 28
+
+struct snapshot_header {
+    __u32 magic;
+    __u32 lists;
+};
+
+struct snapshot_list {
+    // NUL terminated and zero padded
+    char name[SNAPSHOT_NAME_LEN];
+    __u32 max_elts;
+    __u32 elts;
+};
+
+#endif /* _MODSNAPSHOT_H */
@@ -0,0 +1,132 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM multilist
+
+#if !defined(_MULTILIST_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MULTILIST_TRACE_H
+
+// Tracepoints of multilist, all of them off by default. Enable them
+// through tracefs, for instance:
+//
+//   echo 1 > /sys/kernel/debug/tracing/events/multilist/enable
+//   cat /sys/kernel/debug/tracing/trace_pipe
+//
+// `name` is the /proc/list entry the event happened on
+
+#include <linux/tracepoint.h>
+
+// A read() returning `size` bytes of the list, 0 when it's empty
+TRACE_EVENT(multilist_read,
+    TP_PROTO(const char* name, int size),
+    TP_ARGS(name, size),
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(int, size)
+    ),
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->size = size;
+    ),
+    TP_printk("list=%s size=%d", __get_str(name), __entry->size)
+);
+
+// An add / remove / cleanup, the list holds `elts` elements after it
+TRACE_EVENT(multilist_op,
+    TP_PROTO(const char* name, const char* op, int value, int elts),
+    TP_ARGS(name, op, value, elts),
+    TP_STRUCT__entry(
+        __string(name, name)
+        __string(op, op)
+        __field(int, value)
+        __field(int, elts)
+    ),
+    TP_fast_assign(
+        __assign_str(name, name);
+        __assign_str(op, op);
+        __entry->value = value;
+        __entry->elts = elts;
+    ),
+    TP_printk("list=%s op=%s value=%d elts=%d", __get_str(name),
+              __get_str(op), __entry->value, __entry->elts)
+);
+
+// A create / delete written to the control entry
+TRACE_EVENT(multilist_control,
+    TP_PROTO(const char* op, const char* name),
+    TP_ARGS(op, name),
+    TP_STRUCT__entry(
+        __string(op, op)
+        __string(name, name)
+    ),
+    TP_fast_assign(
+        __assign_str(op, op);
+        __assign_str(name, name);
+    ),
+    TP_printk("op=%s list=%s", __get_str(op), __get_str(name))
+);
+
+// A dump / restore of `lists` lists through a `bytes` long image
+TRACE_EVENT(multilist_snapshot,
+    TP_PROTO(const char* op, int lists, size_t bytes),
+    TP_ARGS(op, lists, bytes),
+    TP_STRUCT__entry(
+        __string(op, op)
+        __field(int, lists)
+        __field(size_t, bytes)
+    ),
+    TP_fast_assign(
+        __assign_str(op, op);
+        __entry->lists = lists;
+        __entry->bytes = bytes;
+    ),
+    TP_printk("op=%s lists=%d bytes=%zu", __get_str(op), __entry->lists,
+              __entry->bytes)
+);
+
+// A put / get / del on /proc/kv of the key hashing to `hash`. `ret` is
+// the length of the value for a get, 0 otherwise, or a negative error
+TRACE_EVENT(multilist_kv,
+    TP_PROTO(const char* op, u32 hash, int ret),
+    TP_ARGS(op, hash, ret),
+    TP_STRUCT__entry(
+        __string(op, op)
+        __field(u32, hash)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __assign_str(op, op);
+        __entry->hash = hash;
+        __entry->ret = ret;
+    ),
+    TP_printk("op=%s hash=%08x ret=%d", __get_str(op), __entry->hash,
+              __entry->ret)
+);
+
+// The /proc/kv table started growing or shrinking from 2^old_bits to
+// 2^bits buckets, holding `count` entries, or is `done` migrating them
+TRACE_EVENT(multilist_kv_resize,
+    TP_PROTO(unsigned int old_bits, unsigned int bits, int count, bool done),
+    TP_ARGS(old_bits, bits, count, done),
+    TP_STRUCT__entry(
+        __field(unsigned int, old_bits)
+        __field(unsigned int, bits)
+        __field(int, count)
+        __field(bool, done)
+    ),
+    TP_fast_assign(
+        __entry->old_bits = old_bits;
+        __entry->bits = bits;
+        __entry->count = count;
+        __entry->done = done;
+    ),
+    TP_printk("old_bits=%u bits=%u count=%d %s", __entry->old_bits,
+              __entry->bits, __entry->count,
+              __entry->done ? "done" : "started")
+);
+
+#endif /* _MULTILIST_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE multilist_trace
+#include <trace/define_trace.h>
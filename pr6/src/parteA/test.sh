@@ -0,0 +1,101 @@
+#!/usr/bin/env bash
+
+# Number of parallel waiters per scenario
+parallelism=4
+
+export proc_dir="/proc/list"
+export control_file="${proc_dir}/control"
+
+create_list() {
+    echo "create $*" > "${control_file}"
+}
+
+delete_list() {
+    echo "delete $*" > "${control_file}"
+}
+
+# Block in poll(), select() or epoll on a list until it reports an event,
+# print the events seen. Needs python3 for the syscalls
+wait_on_list() {
+    local mode="$1"
+    local list="$2"
+
+    python3 - "${mode}" "${proc_dir}/${list}" <<'EOF'
+import select
+import sys
+
+mode, path = sys.argv[1], sys.argv[2]
+with open(path, "r") as f:
+    if mode == "poll":
+        p = select.poll()
+        p.register(f, select.POLLIN)
+        events = p.poll(10000)
+        print("poll", events[0][1] if events else "timeout")
+    elif mode == "select":
+        r, _, x = select.select([f], [], [f], 10)
+        print("select", "ready" if r or x else "timeout")
+    else:
+        e = select.epoll()
+        e.register(f.fileno(), select.EPOLLIN)
+        events = e.poll(10)
+        print("epoll", events[0][1] if events else "timeout")
+        e.close()
+EOF
+}
+export -f wait_on_list
+
+# Every waiter must wake up with POLLIN once the list changes
+poll_change() {
+    local mode="$1"
+
+    create_list poll_test
+    for i in $(seq 1 "${parallelism}"); do
+        wait_on_list "${mode}" poll_test &
+    done
+
+    sleep 1
+    echo "add 1" > "${proc_dir}/poll_test"
+    wait
+    delete_list poll_test
+}
+
+# Delete the list while waiters sleep on it, they must wake up with
+# POLLHUP and the module must not touch the freed wait queue
+poll_delete() {
+    local mode="$1"
+
+    create_list poll_test
+    for i in $(seq 1 "${parallelism}"); do
+        wait_on_list "${mode}" poll_test &
+    done
+
+    sleep 1
+    delete_list poll_test
+    wait
+}
+
+main() {
+    if [[ ! -a "${control_file}" ]]; then
+        echo "Module not loaded, aborting..."
+        exit -1
+    fi
+
+    for mode in poll select epoll; do
+        echo "${mode}_change, should wake every waiter with POLLIN"
+        poll_change "${mode}"
+
+        echo "${mode}_delete, should wake every waiter with POLLHUP"
+        poll_delete "${mode}"
+    done
+
+    # Freed callback_data are only reused after a grace period, repeat
+    # the delete under waiters to give a use-after-free a chance to show
+    echo "poll_delete_loop, should wake every waiter and leave no oops in dmesg"
+    for i in $(seq 1 20); do
+        poll_delete poll > /dev/null
+        poll_delete select > /dev/null
+    done
+    dmesg | tail -n 5
+}
+
+main "$@"
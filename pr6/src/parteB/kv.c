@@ -1,25 +1,30 @@
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <time.h>
+
+#include "../parteA/modkv_ioctl.h"
+#include "../parteA/modsnapshot.h"
 
 #define BUCKETS 10
 #define MODULE_PATH "/proc/list/"
 #define DEFAULT_LIST_NAME "default"
 #define CONTROL_FILE "/proc/list/control"
+#define SNAPSHOT_FILE "/proc/list/snapshot"
+#define KV_FILE "/proc/kv"
 
-// https://stackoverflow.com/a/8465083
-char* concat(const char *s1, const char *s2) {
-    const size_t len1 = strlen(s1);
-    const size_t len2 = strlen(s2);
-    char *result = malloc(len1 + len2 + 1);
-    memcpy(result, s1, len1);
-    memcpy(result + len1, s2, len2+1);
-    return result;
-}
+// Number of bucket lists keys are spread across, -b
+static int buckets = BUCKETS;
 
 int create_list(char* name) {
     FILE* fd;
@@ -31,16 +36,6 @@ int create_list(char* name) {
     return fclose(fd);
 }
 
-int add_to_list(char* list_path, int val) {
-    FILE* fd;
-    if ((fd = fopen(list_path, "w+")) == NULL) {
-        return -1;
-    }
-
-    fprintf(fd, "add %d\n", val);
-    return fclose(fd);
-}
-
 int delete_list(char* name) {
     FILE* fd;
     if ((fd = fopen(CONTROL_FILE, "w+")) == NULL) {
@@ -51,30 +46,30 @@ int delete_list(char* name) {
     return fclose(fd);
 }
 
+// Every bucket in a single control write, "0..buckets-1"
+void bucket_range(char* range, size_t len) {
+    snprintf(range, len, "0..%d", buckets - 1);
+}
+
 int create_buckets(void) {
     int ret = 0;
-    int i;
-    int sz;
+    char range[32];
     DIR *dir;
     if ((dir = opendir(MODULE_PATH)) == NULL) {
         printf("Couldn't open proc folder\n");
         return -1;
     }
 
+    bucket_range(range, sizeof(range));
+
     // We don't care about the default entry
     delete_list(DEFAULT_LIST_NAME);
 
-    for (i = 0; i < BUCKETS; i++) {
-        sz = snprintf(NULL, 0, "%d", i);
-        char list_name[sz + 1];
-        snprintf(list_name, sizeof(list_name), "%d", i);
-        // We dont' care if the list doesn't exist
-        delete_list(list_name);
+    // We dont' care if the lists don't exist
+    delete_list(range);
 
-        if (create_list(list_name) == -1) {
-            ret = -1;
-            break;
-        }
+    if (create_list(range) != 0) {
+        ret = -1;
     }
 
     closedir(dir);
@@ -84,22 +79,16 @@ int create_buckets(void) {
 
 int delete_buckets(void) {
     int ret = 0;
-    int i;
-    int sz;
+    char range[32];
     DIR *dir;
     if ((dir = opendir(MODULE_PATH)) == NULL) {
         printf("Couldn't open proc folder\n");
         return -1;
     }
 
-    for (i = 0; i < BUCKETS; i++) {
-        sz = snprintf(NULL, 0, "%d", i);
-        char list_name[sz + 1];
-        snprintf(list_name, sizeof(list_name), "%d", i);
-        if (delete_list(list_name) == -1) {
-            ret = -1;
-            break;
-        }
+    bucket_range(range, sizeof(range));
+    if (delete_list(range) != 0) {
+        ret = -1;
     }
 
     closedir(dir);
@@ -112,77 +101,812 @@ unsigned long hash(unsigned char *str) {
     unsigned long hash = 5381;
     int c;
 
-    while (c = *str++)
+    while ((c = *str++))
         hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
 
     return hash;
 }
 
+// Jump consistent hash, Lamping & Veach, https://arxiv.org/abs/1406.2294
+// Maps `key` to one of `num_buckets`, and when they grow to M only
+// 1/M of the keys move, all of them to the new buckets
+int jump_hash(uint64_t key, int num_buckets) {
+    int64_t b = -1;
+    int64_t j = 0;
+
+    while (j < num_buckets) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (b + 1) * ((double) (1LL << 31) / (double) ((key >> 33) + 1));
+    }
+
+    return b;
+}
+
 int bucket_for_key(char* key) {
-    unsigned long h = hash(key);
-    return h % BUCKETS;
+    unsigned long h = hash((unsigned char*) key);
+    return jump_hash(h, buckets);
+}
+
+// Bucket lists hold the number of their key, "key<value>"
+int bucket_for_value(long value, int num_buckets) {
+    char key[32];
+    snprintf(key, sizeof(key), "key%ld", value);
+    return jump_hash(hash((unsigned char*) key), num_buckets);
 }
 
-void write_into_list(char* list_name, int value) {
-    char* full_path = concat(MODULE_PATH, list_name);
-    add_to_list(full_path, value);
-    free(full_path);
+int bucket_command(int bucket, char* op, int value) {
+    FILE* fd;
+    char path[32];
+
+    snprintf(path, sizeof(path), MODULE_PATH "%d", bucket);
+    if ((fd = fopen(path, "w+")) == NULL) {
+        return -1;
+    }
+
+    fprintf(fd, "%s %d\n", op, value);
+    return fclose(fd);
 }
 
-int put(char* key, int value) {
-    int bucket = bucket_for_key(key);
-    char s_bucket[1];
-    sprintf(s_bucket, "%d", bucket);
-    write_into_list(s_bucket, value);
+// Number of bucket lists in /proc/list, the ones with a numeric name
+int count_buckets(void) {
+    int count = 0;
+    DIR *dir;
+    struct dirent* entry;
+    if ((dir = opendir(MODULE_PATH)) == NULL) {
+        printf("Couldn't open proc folder\n");
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '\0' &&
+            strspn(entry->d_name, "0123456789") == strlen(entry->d_name)) {
+            count++;
+        }
+    }
+
+    closedir(dir);
+
+    return count;
 }
 
-int main(int argc, char** argv) {
-    // if (create_buckets() == -1) {
-    //     printf("Couldn't create buckets\n");
-    // }
+// Image of every list, dumped through the snapshot entry as it isn't
+// cut at a page like a list read. Returns its length, -1 on error
+ssize_t read_snapshot(char** image) {
+    FILE* fd;
+    char* grown;
+    size_t cap = 4096;
+    size_t len = 0;
+    size_t bytes;
 
-    // if (argc != 3) {
-    //     printf("Usage: %s <key> <value>\n", argv[0]);
-    //     return -1;
-    // }
+    if ((fd = fopen(CONTROL_FILE, "w+")) == NULL) {
+        return -1;
+    }
 
-    // char* command = argv[1];
-    // char* key = argv[2];
-    // int value = atoi(argv[3]);
+    fprintf(fd, "dump\n");
+    if (fclose(fd) != 0 || (fd = fopen(SNAPSHOT_FILE, "r")) == NULL) {
+        return -1;
+    }
 
-    // printf("%d\n", bucket_for_key(key));
-    // put(key, value);
+    *image = NULL;
+    do {
+        if ((grown = realloc(*image, cap *= 2)) == NULL) {
+            free(*image);
+            fclose(fd);
+            return -1;
+        }
 
-    // if (delete_buckets() == -1) {
-    //     printf("Couldn't delete buckets\n");
-    // }
+        *image = grown;
+        bytes = fread(*image + len, 1, cap - len, fd);
+        len += bytes;
+    } while (len == cap);
 
-    int opt;
-    char* key;
-    int value;
-    int flags = 0;
+    fclose(fd);
+    return len;
+}
+
+// Move the values of bucket `from` that belong elsewhere with
+// `num_buckets` buckets. Each one is added to its new bucket before it's
+// removed from `from`, so it's never missing, only briefly in both
+int migrate_bucket(int from, const __s32* values, __u32 count,
+                   int num_buckets) {
+    int ret = 0;
+    int to;
+    __u32 i;
+
+    for (i = 0; i < count; i++) {
+        to = bucket_for_value(values[i], num_buckets);
+        if (to == from) {
+            continue;
+        }
+
+        if (bucket_command(to, "add", values[i]) != 0 ||
+            bucket_command(from, "remove", values[i]) != 0) {
+            fprintf(stderr, "Couldn't move %d from bucket %d to %d\n",
+                    values[i], from, to);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+// Grow or shrink the bucket lists to `target` while they're in use, and
+// move the values that map elsewhere. Buckets are picked with jump_hash,
+// so growing from N to M buckets only moves the values that land on the
+// new ones, (M - N) / M of them, and shrinking only the values of the
+// removed buckets
+int resize_buckets(int target) {
+    int ret = 0;
+    int current = count_buckets();
+    int bucket;
+    char range[32];
+    char* end;
+    char* image = NULL;
+    ssize_t len;
+    size_t pos = sizeof(struct snapshot_header);
+    struct snapshot_header* header;
+    struct snapshot_list* record;
+    __u32 i;
+
+    if (current == -1 || target < 1) {
+        return -1;
+    }
+
+    if (target == current) {
+        return 0;
+    }
+
+    if (target > current) {
+        snprintf(range, sizeof(range), "%d..%d", current, target - 1);
+        if (create_list(range) != 0) {
+            return -1;
+        }
+    }
+
+    if ((len = read_snapshot(&image)) < (ssize_t) sizeof(struct snapshot_header)) {
+        free(image);
+        return -1;
+    }
+
+    header = (struct snapshot_header*) image;
+    if (header->magic != SNAPSHOT_MAGIC) {
+        free(image);
+        return -1;
+    }
+
+    for (i = 0; i < header->lists && ret == 0; i++) {
+        if (len - pos < sizeof(struct snapshot_list)) {
+            ret = -1;
+            break;
+        }
+
+        record = (struct snapshot_list*) (image + pos);
+        pos += sizeof(struct snapshot_list);
+        if ((len - pos) / sizeof(__s32) < record->elts) {
+            ret = -1;
+            break;
+        }
+        pos += record->elts * sizeof(__s32);
+
+        // Only the buckets that held values before the resize
+        bucket = strtol(record->name, &end, 10);
+        if (*end != '\0' || end == record->name || bucket < 0 ||
+            bucket >= current) {
+            continue;
+        }
+
+        if (migrate_bucket(bucket, (__s32*) (record + 1), record->elts,
+                           target) != 0) {
+            ret = -1;
+        }
+    }
+
+    free(image);
+
+    // Removed buckets are empty unless a move failed, keep them then
+    if (ret == 0 && target < current) {
+        snprintf(range, sizeof(range), "%d..%d", target, current - 1);
+        ret = delete_list(range);
+    }
+
+    if (ret == 0) {
+        buckets = target;
+    }
+
+    return ret;
+}
+
+// Store an int64 under `key` in the KV module, one ioctl
+int kv_put(int fd, char* key, int64_t value) {
+    struct kv_ioc req = {
+        .key = (uintptr_t) key,
+        .value = (uintptr_t) &value,
+        .key_len = strlen(key),
+        .value_len = sizeof(value),
+        .type = KV_TYPE_INT,
+    };
+
+    return ioctl(fd, KV_IOC_PUT, &req);
+}
+
+// Fetch the value of `key` into `buf`, returns its length or -1.
+// Ints are stored in `buf` as an int64_t
+int kv_get(int fd, char* key, void* buf, size_t len, unsigned int* type) {
+    struct kv_ioc req = {
+        .key = (uintptr_t) key,
+        .value = (uintptr_t) buf,
+        .key_len = strlen(key),
+        .value_len = len,
+    };
+
+    if (ioctl(fd, KV_IOC_GET, &req) == -1) {
+        return -1;
+    }
+
+    *type = req.type;
+    return req.value_len;
+}
+
+int kv_del(int fd, char* key) {
+    struct kv_ioc req = {
+        .key = (uintptr_t) key,
+        .key_len = strlen(key),
+    };
+
+    return ioctl(fd, KV_IOC_DEL, &req);
+}
+
+// Load generator, -x. Every thread runs `ops` operations picked from the
+// put / get / del mix, against /proc/kv or, with -l, the /proc/list
+// buckets. Keys are uniform or zipfian, -z <theta>. Prints one line per
+// operation type:
+//
+//   op=get count=300000 misses=0 errors=0 ops_per_sec=... p50_ns=...
+//
+// For instance, 8 threads with 90% gets on a skewed key space:
+//
+//   ./kv -x -j 8 -o 1000000 -m 5:90:5 -K 100000 -z 0.99
+//
+// Each bucket list holds at most the max_size of the list module, puts
+// fail with ENOSPC past it and count as errors. Load it with max_size of
+// at least keys / buckets to compare against /proc/kv
+
+enum bench_op { BENCH_PUT = 0, BENCH_GET, BENCH_DEL, BENCH_OPS };
+
+static const char* bench_op_names[BENCH_OPS] = {"put", "get", "del"};
+
+struct bench_config {
+    int threads;
+    long ops;
+    long keys;
+    // Percentage of puts / gets / dels, adding up to 100
+    int mix[BENCH_OPS];
+    // Zipfian skew, 0 for uniform keys
+    double theta;
+    // Use the /proc/list buckets instead of /proc/kv
+    int lists;
+};
+
+// Zipfian generator of Gray et al., "Quickly generating billion-record
+// synthetic databases", as used by YCSB
+struct zipf {
+    long n;
+    // Coprime to `n`, scatters the ranks over the key space
+    unsigned long scatter;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+};
+
+struct bench_thread {
+    pthread_t tid;
+    int id;
+    uint64_t rng;
+    struct bench_config* config;
+    struct zipf* zipf;
+    pthread_barrier_t* barrier;
+    // Descriptor of /proc/kv, or one per bucket with -l
+    int kv_fd;
+    int* bucket_fds;
+    // Latency of every operation, by type
+    uint64_t* lat[BENCH_OPS];
+    long count[BENCH_OPS];
+    long misses[BENCH_OPS];
+    long errors[BENCH_OPS];
+};
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// xorshift64*, one state per thread
+static uint64_t bench_rand(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static double bench_rand_double(uint64_t* state) {
+    return (bench_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static unsigned long gcd(unsigned long a, unsigned long b) {
+    unsigned long t;
+
+    while (b != 0) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
 
-    while ((opt = getopt(argc, argv, "ntk:v:")) != -1) {
+    return a;
+}
+
+static void zipf_init(struct zipf* z, long n, double theta) {
+    long i;
+    double zeta2 = 1.0 + pow(0.5, theta);
+
+    z->n = n;
+    // Around n / golden ratio, the first coprime to `n` from there
+    z->scatter = (unsigned long) (n * 0.6180339887498949);
+    while (z->scatter == 0 || gcd(z->scatter, n) != 1) {
+        z->scatter++;
+    }
+
+    z->theta = theta;
+    z->alpha = 1.0 / (1.0 - theta);
+    z->zetan = 0;
+    for (i = 1; i <= n; i++) {
+        z->zetan += 1.0 / pow((double) i, theta);
+    }
+    z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+// Rank 0 is the most popular
+static long zipf_next(struct zipf* z, uint64_t* state) {
+    double u = bench_rand_double(state);
+    double uz = u * z->zetan;
+    long rank;
+
+    if (uz < 1.0) {
+        return 0;
+    }
+
+    if (uz < 1.0 + pow(0.5, z->theta)) {
+        return 1;
+    }
+
+    rank = z->n * pow(z->eta * u - z->eta + 1.0, z->alpha);
+    return (rank < z->n) ? rank : z->n - 1;
+}
+
+static long bench_key(struct bench_thread* t) {
+    long rank;
+
+    if (t->zipf == NULL) {
+        return bench_rand(&t->rng) % t->config->keys;
+    }
+
+    // Scatter the popular ranks over the key space, and the buckets.
+    // Multiplying by a number coprime to `keys` permutes [0, keys), so
+    // every rank keeps its own key and its probability
+    rank = zipf_next(t->zipf, &t->rng);
+    return (unsigned __int128) rank * t->zipf->scatter % t->config->keys;
+}
+
+static enum bench_op bench_pick_op(struct bench_thread* t) {
+    int r = bench_rand(&t->rng) % 100;
+
+    if (r < t->config->mix[BENCH_PUT]) {
+        return BENCH_PUT;
+    }
+
+    if (r < t->config->mix[BENCH_PUT] + t->config->mix[BENCH_GET]) {
+        return BENCH_GET;
+    }
+
+    return BENCH_DEL;
+}
+
+// One operation on /proc/kv, 1 on a miss, -1 on error
+static int bench_kv_op(int fd, enum bench_op op, long key) {
+    char name[32];
+    char buf[KV_MAX_VALUE];
+    unsigned int type;
+    int ret;
+
+    snprintf(name, sizeof(name), "key%ld", key);
+
+    switch (op) {
+    case BENCH_PUT:
+        ret = kv_put(fd, name, key);
+        break;
+    case BENCH_GET:
+        ret = kv_get(fd, name, buf, sizeof(buf), &type);
+        break;
+    default:
+        ret = kv_del(fd, name);
+        break;
+    }
+
+    if (ret == -1) {
+        return (errno == ENOENT) ? 1 : -1;
+    }
+
+    return 0;
+}
+
+// One operation on the bucket of `key`, whose lists hold bare values.
+// A get reads the whole bucket, as kv.c had to before /proc/kv
+static int bench_list_op(int* fds, enum bench_op op, long key) {
+    char name[32];
+    char buf[4096];
+    int len;
+    int fd;
+
+    snprintf(name, sizeof(name), "key%ld", key);
+    fd = fds[bucket_for_key(name)];
+
+    switch (op) {
+    case BENCH_PUT:
+        len = snprintf(buf, sizeof(buf), "add %ld\n", key);
+        break;
+    case BENCH_GET:
+        if (pread(fd, buf, sizeof(buf), 0) == -1) {
+            return -1;
+        }
+        return 0;
+    default:
+        len = snprintf(buf, sizeof(buf), "remove %ld\n", key);
+        break;
+    }
+
+    return (pwrite(fd, buf, len, 0) == -1) ? -1 : 0;
+}
+
+static void* bench_worker(void* arg) {
+    struct bench_thread* t = arg;
+    struct bench_config* config = t->config;
+    enum bench_op op;
+    long long start;
+    long key;
+    long i;
+    int ret;
+
+    // Every thread fills its share of the keys, so gets hit
+    if (!config->lists) {
+        for (key = t->id; key < config->keys; key += config->threads) {
+            bench_kv_op(t->kv_fd, BENCH_PUT, key);
+        }
+    }
+
+    pthread_barrier_wait(t->barrier);
+
+    for (i = 0; i < config->ops; i++) {
+        op = bench_pick_op(t);
+        key = bench_key(t);
+
+        start = now_ns();
+        if (config->lists) {
+            ret = bench_list_op(t->bucket_fds, op, key);
+        } else {
+            ret = bench_kv_op(t->kv_fd, op, key);
+        }
+        t->lat[op][t->count[op]++] = now_ns() - start;
+
+        if (ret == 1) {
+            t->misses[op]++;
+        } else if (ret == -1) {
+            t->errors[op]++;
+        }
+    }
+
+    return NULL;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t* sorted, long count, double p) {
+    long idx;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    idx = (long) (p * count);
+    return sorted[(idx < count) ? idx : count - 1];
+}
+
+static void bench_report(const char* op, uint64_t* lat, long count,
+                         long misses, long errors, long long total_ns) {
+    qsort(lat, count, sizeof(uint64_t), cmp_u64);
+
+    printf("op=%s count=%ld misses=%ld errors=%ld ops_per_sec=%.0f "
+           "p50_ns=%llu p90_ns=%llu p99_ns=%llu p999_ns=%llu max_ns=%llu\n",
+           op, count, misses, errors, count * 1e9 / (total_ns > 0 ? total_ns : 1),
+           (unsigned long long) percentile(lat, count, 0.50),
+           (unsigned long long) percentile(lat, count, 0.90),
+           (unsigned long long) percentile(lat, count, 0.99),
+           (unsigned long long) percentile(lat, count, 0.999),
+           (unsigned long long) (count > 0 ? lat[count - 1] : 0));
+}
+
+int run_bench(struct bench_config* config) {
+    int i;
+    int b;
+    int op;
+    long total;
+    long offset;
+    long long start;
+    long long total_ns;
+    char name[32];
+    struct zipf zipf;
+    pthread_barrier_t barrier;
+    struct bench_thread* threads;
+    uint64_t* all;
+    long misses = 0;
+    long errors = 0;
+    long op_misses;
+    long op_errors;
+    long start_op;
+
+    if (config->theta > 0) {
+        if (config->theta >= 1.0) {
+            fprintf(stderr, "Zipfian theta must be in (0, 1)\n");
+            return -1;
+        }
+        zipf_init(&zipf, config->keys, config->theta);
+    }
+
+    if (config->lists) {
+        fprintf(stderr, "Bucket lists hold up to max_size values each, "
+                "puts past it fail\n");
+    }
+
+    threads = calloc(config->threads, sizeof(struct bench_thread));
+    if (threads == NULL) {
+        perror("Couldn't allocate the threads");
+        exit(EXIT_FAILURE);
+    }
+    pthread_barrier_init(&barrier, NULL, config->threads + 1);
+
+    for (i = 0; i < config->threads; i++) {
+        threads[i].id = i;
+        threads[i].rng = 0x2545F4914F6CDD1DULL * (i + 1);
+        threads[i].config = config;
+        threads[i].zipf = (config->theta > 0) ? &zipf : NULL;
+        threads[i].barrier = &barrier;
+
+        for (op = 0; op < BENCH_OPS; op++) {
+            threads[i].lat[op] = malloc(config->ops * sizeof(uint64_t));
+            if (threads[i].lat[op] == NULL) {
+                perror("Couldn't allocate the latencies");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if (config->lists) {
+            threads[i].bucket_fds = malloc(buckets * sizeof(int));
+            if (threads[i].bucket_fds == NULL) {
+                perror("Couldn't allocate the buckets");
+                exit(EXIT_FAILURE);
+            }
+
+            for (b = 0; b < buckets; b++) {
+                snprintf(name, sizeof(name), MODULE_PATH "%d", b);
+                if ((threads[i].bucket_fds[b] = open(name, O_RDWR)) == -1) {
+                    fprintf(stderr, "Couldn't open %s: %s, create the buckets with -n\n",
+                            name, strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+            }
+        } else if ((threads[i].kv_fd = open(KV_FILE, O_RDWR)) == -1) {
+            perror("Couldn't open " KV_FILE);
+            exit(EXIT_FAILURE);
+        }
+
+        pthread_create(&threads[i].tid, NULL, bench_worker, &threads[i]);
+    }
+
+    // Start timing once every thread filled its keys
+    pthread_barrier_wait(&barrier);
+    start = now_ns();
+
+    for (i = 0; i < config->threads; i++) {
+        pthread_join(threads[i].tid, NULL);
+    }
+    total_ns = now_ns() - start;
+
+    all = malloc(config->threads * config->ops * sizeof(uint64_t));
+    if (all == NULL) {
+        perror("Couldn't allocate the latencies");
+        exit(EXIT_FAILURE);
+    }
+
+    offset = 0;
+    for (op = 0; op < BENCH_OPS; op++) {
+        start_op = offset;
+        op_misses = 0;
+        op_errors = 0;
+
+        for (i = 0; i < config->threads; i++) {
+            memcpy(all + offset, threads[i].lat[op],
+                   threads[i].count[op] * sizeof(uint64_t));
+            offset += threads[i].count[op];
+            op_misses += threads[i].misses[op];
+            op_errors += threads[i].errors[op];
+        }
+
+        total = offset - start_op;
+        misses += op_misses;
+        errors += op_errors;
+
+        // Sorts this slice of `all`, the "all" line sorts it whole later
+        bench_report(bench_op_names[op], all + start_op, total, op_misses,
+                     op_errors, total_ns);
+    }
+
+    bench_report("all", all, offset, misses, errors, total_ns);
+
+    printf("target=%s threads=%d keys=%ld dist=%s theta=%.2f mix=%d:%d:%d "
+           "total_ns=%lld\n",
+           config->lists ? "lists" : "kv", config->threads, config->keys,
+           (config->theta > 0) ? "zipf" : "uniform", config->theta,
+           config->mix[BENCH_PUT], config->mix[BENCH_GET],
+           config->mix[BENCH_DEL], total_ns);
+
+    for (i = 0; i < config->threads; i++) {
+        for (op = 0; op < BENCH_OPS; op++) {
+            free(threads[i].lat[op]);
+        }
+
+        if (config->lists) {
+            for (b = 0; b < buckets; b++) {
+                close(threads[i].bucket_fds[b]);
+            }
+            free(threads[i].bucket_fds);
+        } else {
+            close(threads[i].kv_fd);
+        }
+    }
+
+    pthread_barrier_destroy(&barrier);
+    free(threads);
+    free(all);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int fd;
+    int opt;
+    int len;
+    int ret = 0;
+    char* key = NULL;
+    char* value = NULL;
+    int delete = 0;
+    int bench = 0;
+    unsigned int type;
+    char buf[KV_MAX_VALUE];
+    struct bench_config config = {
+        .threads = 4,
+        .ops = 100000,
+        .keys = 100000,
+        .mix = {20, 75, 5},
+        .theta = 0,
+        .lists = 0,
+    };
+
+    while ((opt = getopt(argc, argv, "ntdk:v:b:r:xj:o:m:K:z:l")) != -1) {
         switch (opt) {
+            case 'x':
+                bench = 1;
+                break;
+            case 'j':
+                config.threads = atoi(optarg);
+                break;
+            case 'o':
+                config.ops = atol(optarg);
+                break;
+            case 'm':
+                if (sscanf(optarg, "%d:%d:%d", &config.mix[BENCH_PUT],
+                           &config.mix[BENCH_GET], &config.mix[BENCH_DEL]) != 3 ||
+                    config.mix[BENCH_PUT] + config.mix[BENCH_GET] +
+                    config.mix[BENCH_DEL] != 100) {
+                    fprintf(stderr, "Mix is put:get:del, adding up to 100\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'K':
+                config.keys = atol(optarg);
+                break;
+            case 'z':
+                config.theta = atof(optarg);
+                break;
+            case 'l':
+                config.lists = 1;
+                break;
+            case 'b':
+                buckets = atoi(optarg);
+                if (buckets < 1) {
+                    fprintf(stderr, "Need at least one bucket\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                if (resize_buckets(atoi(optarg)) != 0) {
+                    printf("Couldn't resize buckets\n");
+                }
+                break;
             case 'n':
-                printf("Setup\n");
+                if (create_buckets() == -1) {
+                    printf("Couldn't create buckets\n");
+                }
                 break;
             case 't':
-                printf("Tear-down\n");
+                if (delete_buckets() == -1) {
+                    printf("Couldn't delete buckets\n");
+                }
+                break;
+            case 'd':
+                delete = 1;
                 break;
             case 'k':
                 key = optarg;
-                printf("Key: %s\n", key);
                 break;
             case 'v':
-                value = atoi(optarg);
-                printf("Value: %d\n", value);
+                value = optarg;
                 break;
             default:
-                fprintf(stderr, "Usage %s [-nt] [-k <key>] [-v <value]\n", argv[0]);
+                fprintf(stderr, "Usage %s [-b <buckets>] [-nt] [-r <buckets>] [-k <key> [-d | -v <value>]]\n", argv[0]);
+                fprintf(stderr, "       %s -x [-j <threads>] [-o <ops>] [-m <put:get:del>] [-K <keys>] [-z <theta>] [-l]\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
 
-    exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+    if (bench) {
+        if (config.threads < 1 || config.ops < 1 || config.keys < 1) {
+            fprintf(stderr, "Threads, ops and keys must be positive\n");
+            exit(EXIT_FAILURE);
+        }
+
+        exit((run_bench(&config) == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    if (key == NULL) {
+        exit(EXIT_SUCCESS);
+    }
+
+    if ((fd = open(KV_FILE, O_RDWR)) == -1) {
+        perror("Couldn't open " KV_FILE);
+        exit(EXIT_FAILURE);
+    }
+
+    if (delete) {
+        ret = kv_del(fd, key);
+    } else if (value != NULL) {
+        ret = kv_put(fd, key, strtoll(value, NULL, 10));
+    } else if ((len = kv_get(fd, key, buf, sizeof(buf), &type)) == -1) {
+        ret = -1;
+    } else if (type == KV_TYPE_INT) {
+        printf("%lld\n", (long long) *(int64_t*) buf);
+    } else {
+        fwrite(buf, 1, len, stdout);
+        printf("\n");
+    }
+
+    if (ret == -1) {
+        fprintf(stderr, "%s: %s\n", key, strerror(errno));
+    }
+
+    close(fd);
+    exit((ret == -1) ? EXIT_FAILURE : EXIT_SUCCESS);
+}